@@ -1,4 +1,6 @@
 #pragma once
 bool gameLogic(float deltaTime); // false for exit, true for continue
+bool hasNewFrame();				 // true if the last gameLogic call rendered something that should be presented
+float getWaitTimeout();			 // how long the main loop may sleep before gameLogic has to run again, in seconds
 void closeGame();
 void startGame();
\ No newline at end of file
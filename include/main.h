@@ -5,6 +5,9 @@
 #include <string_view>
 #include "bitflags.hpp"
 #include "styledScreen.h"
+#include "palette.h"
+#include "utf8.h"
+#include "vtParser.h"
 
 struct TermFlags {
   public:
@@ -25,33 +28,34 @@ struct TermFlags {
 	DEFINE_BITFLAGS(TermFlags);
 };
 
-enum class ProcState : uint8_t {
-	None,
-	SawESC,
-	SawCSIBracket,
-	SawOSCBracket,
-	SawOSCBracketAndESC,
-};
-
 struct InputProcessorState {
-	std::string leftover;
-	std::string escBuf;
-	ProcState state = ProcState::None;
+	std::string escBuf; // OSC payload
+	CsiParams csi;		// parameters and intermediates of the current CSI/ESC/DCS sequence
+	VtState state = VtState::Ground;
+	Utf8Decoder utf8;
 	TermColor currFG = TermColor::DefaultForeGround();
 	TermColor currBG = TermColor::DefaultBackGround();
 	TextAttribute currAttr = TextAttribute::None;
+	uint32_t pen = StyleTable::DefaultStyle; // currFG/currBG/currAttr interned in o.screen, updated on every SGR
+	uint64_t unknownSequences = 0; // CSI sequences with no handler, for debugging
+};
+
+struct SavedCursor {
+	int x = 0;
+	int y = 0;
 };
 
 struct Data {
 	InputProcessorState procState;
 	std::string command;
 	StyledScreen screen;
+	Palette palette;
 	float fontWidth, fontHeight = 0;
 	int cursorX = 0, cursorY = 0;
 	int rows = 0, cols = 0;
 	TermFlags flags;
 	int scrollbackOffset = 0;
-	ScreenState backupState;
+	SavedCursor savedCursors[2]; // DECSC/DECRC, the primary and the alternate screen each have their own
 	bool needResize = false;
 };
 
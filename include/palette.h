@@ -0,0 +1,28 @@
+#pragma once
+#include "styledChar.h"
+#include <string_view>
+
+// The colors indexed and default TermColors stand for. OSC 4/10/11 and their resets change it at any time,
+// the renderer resolves cell colors through it every frame.
+struct Palette {
+	static constexpr int Size = 256;
+
+	TermColor colors[Size] = {};
+	TermColor foreground = DefaultForeground;
+	TermColor background = DefaultBackground;
+
+	static constexpr TermColor DefaultForeground = TermColor(255, 255, 255);
+	static constexpr TermColor DefaultBackground = TermColor(0, 0, 0);
+
+	Palette();
+	void reset();
+	void resetColor(int index);
+	// The RGB color to draw, `foreground` tells which default a ColorKind::Default color means
+	TermColor resolve(TermColor color, bool foreground) const;
+
+	// xterm's default for a palette index: 16 base colors, a 6x6x6 cube, then a grayscale ramp
+	static TermColor defaultColor(int index);
+};
+
+// X11 color specs as used by OSC 4/10/11: rgb:r/g/b with 1 to 4 hex digits per channel, #rgb or #rrggbb
+bool parseColorSpec(std::string_view spec, TermColor* out);
@@ -1,5 +1,5 @@
 #pragma once
-#include <GLFW/glfw3.h>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -144,8 +144,6 @@ const Button& getRMouseButton();
 
 const std::u32string& getTypedInput();
 
-const char* getClipboard();
-void setClipboard(const char*);
 
 namespace internal
 {
@@ -205,6 +203,8 @@ void updateAllButtons(float deltaTime);
 void resetInputsToZero();
 
 void addToTypedInput(char32_t c);
+void addSpecialInput(SpecialInputEvent e);
+void setScrollLevel(int level);
 void resetTypedInput();
 };
 };
@@ -3,12 +3,21 @@
 #include <string_view>
 #include <cstddef>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include "ringBuffer.hpp"
 
 namespace platform
 {
 
 class Process {
 	std::vector<char> buffer;
+	// Filled by the reader thread, drained into `buffer` by `update()`
+	SpscRingBuffer<char, 1 << 20> pending;
+	std::thread reader;
+	std::atomic<bool> stopReader{false};
+	// Set once the reader has woken the main loop, cleared when `update()` picks the data up
+	std::atomic<bool> wakePosted{false};
 #ifdef _WIN32
 	using W_HPCON = void*;
 	using W_HANDLE = void*;
@@ -20,12 +29,20 @@ class Process {
 	int pid = -1;
 	int masterFd = -1;
 #endif
+	// Runs on `reader`, keeps draining the child's output into `pending`
+	void readerLoop();
+	void startReader();
+	void joinReader();
+	void notifyOutput();
+
   public:
 	Process() = default;
 	~Process();
+	Process(const Process&) = delete;
+	Process& operator=(const Process&) = delete;
 	void launch(int rows, int cols);
 	void write(const char* data, size_t len);
-	// Call periodically to pump in new data from the process
+	// Call once per frame to move everything the reader thread has collected into the output buffer
 	void update();
 	// The buffer is updated by `update()`
 	std::vector<char>& getOutputBuffer();
@@ -33,4 +50,4 @@ class Process {
 	void terminate();
 	void resize(int collumns, int rows);
 };
-}
\ No newline at end of file
+}
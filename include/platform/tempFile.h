@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace platform
+{
+
+// A scratch file that only lives as long as it is open: it is unlinked right after creation on POSIX and
+// opened delete-on-close on Windows, so nothing is left behind even if the process crashes.
+class TempFile {
+#ifdef _WIN32
+	using W_HANDLE = void*;
+	W_HANDLE file = nullptr;
+#else
+	int fd = -1;
+#endif
+
+  public:
+	TempFile() = default;
+	~TempFile();
+	TempFile(const TempFile&) = delete;
+	TempFile& operator=(const TempFile&) = delete;
+	// Creates the file in the system temp directory, returns false if that fails
+	bool open();
+	void close();
+	bool isOpen() const;
+	bool write(uint64_t offset, const void* data, size_t size);
+	// Maps `size` bytes at `offset` for reading and writing, writes go back to the file. The offset has to be a
+	// multiple of 64 KiB. Returns nullptr on failure
+	void* map(uint64_t offset, size_t size);
+	static void unmap(void* address, size_t size);
+};
+}
@@ -31,4 +31,13 @@ void changeVisibility(bool vis);
 
 void setWindowTitle(const char* title);
 
+const char* getClipboard();
+void setClipboard(const char*);
+
+// true when the window system asked for the contents to be drawn again (e.g. after being uncovered)
+bool hasRedrawBeenRequested();
+
+// Wakes the main loop if it is sleeping while waiting for events. Safe to call from any thread.
+void wakeUpEventLoop();
+
 };
\ No newline at end of file
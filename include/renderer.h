@@ -9,5 +9,7 @@
 
 void startRender();
 void render(const std::vector<StyledLine>& screen, int screenW, int screenH);
-void renderCursor(int cursorX, int cursorY, float deltaTime, int screenW, int screenH);
-void stopRender();
\ No newline at end of file
+void renderCursor(int cursorX, int cursorY, int screenW, int screenH);
+void stopRender();
+// Share of the glyph atlas pages in use that glyphs take, 0 to 1
+float getAtlasOccupancy();
\ No newline at end of file
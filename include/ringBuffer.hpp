@@ -0,0 +1,83 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+// Fixed-size lock-free queue for exactly one producer thread and one consumer thread.
+// Capacity must be a power of two. head/tail grow monotonically and are masked on access.
+template <typename T, size_t Capacity>
+class SpscRingBuffer {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+	static_assert(std::is_trivially_copyable<T>::value, "T is copied with memcpy");
+
+  public:
+	SpscRingBuffer() : storage(new T[Capacity]) {
+	}
+
+	SpscRingBuffer(const SpscRingBuffer&) = delete;
+	SpscRingBuffer& operator=(const SpscRingBuffer&) = delete;
+
+	// Producer side. Returns how many elements were actually queued (less than len when full).
+	size_t write(const T* data, size_t len) {
+		size_t tail = writePos.load(std::memory_order_relaxed);
+		size_t head = readPos.load(std::memory_order_acquire);
+		size_t count = std::min(len, Capacity - (tail - head));
+		copyIn(tail, data, count);
+		writePos.store(tail + count, std::memory_order_release);
+		return count;
+	}
+
+	// Consumer side. Returns how many elements were copied into out.
+	size_t read(T* out, size_t maxLen) {
+		size_t head = readPos.load(std::memory_order_relaxed);
+		size_t tail = writePos.load(std::memory_order_acquire);
+		size_t count = std::min(maxLen, tail - head);
+		copyOut(head, out, count);
+		readPos.store(head + count, std::memory_order_release);
+		return count;
+	}
+
+	// Number of elements ready to be read. Exact from the consumer, a lower bound from the producer.
+	size_t size() const {
+		return writePos.load(std::memory_order_acquire) - readPos.load(std::memory_order_acquire);
+	}
+
+	bool full() const {
+		return size() == Capacity;
+	}
+
+	// Only safe while neither side is running.
+	void reset() {
+		readPos.store(0, std::memory_order_relaxed);
+		writePos.store(0, std::memory_order_relaxed);
+	}
+
+	static constexpr size_t capacity() {
+		return Capacity;
+	}
+
+  private:
+	static constexpr size_t Mask = Capacity - 1;
+
+	void copyIn(size_t pos, const T* data, size_t count) {
+		size_t start = pos & Mask;
+		size_t first = std::min(count, Capacity - start);
+		memcpy(storage.get() + start, data, first * sizeof(T));
+		memcpy(storage.get(), data + first, (count - first) * sizeof(T));
+	}
+
+	void copyOut(size_t pos, T* out, size_t count) const {
+		size_t start = pos & Mask;
+		size_t first = std::min(count, Capacity - start);
+		memcpy(out, storage.get() + start, first * sizeof(T));
+		memcpy(out + first, storage.get(), (count - first) * sizeof(T));
+	}
+
+	std::unique_ptr<T[]> storage;
+	// Kept on separate cache lines so the two threads don't false-share.
+	alignas(64) std::atomic<size_t> readPos{0};
+	alignas(64) std::atomic<size_t> writePos{0};
+};
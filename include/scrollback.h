@@ -0,0 +1,180 @@
+#pragma once
+#include "styledChar.h"
+#include <platform/tempFile.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+// Lines that scrolled off the top of the screen, oldest first, kept within a memory budget.
+// Lines are stored compressed: trailing blanks are dropped, styles are stored as runs and codepoints take one
+// byte when the whole line fits in Latin-1. The encoded lines are appended into large blocks and referenced by
+// handles kept in a ring, so once everything is warmed up, pushing a line (and dropping the oldest ones to stay
+// in budget) allocates nothing. Lines leave in the order they came in, so a block is recycled as soon as its
+// last line is dropped.
+//
+// When the memory budget is used up, the oldest blocks are spilled to temporary segment files instead of being
+// dropped, and mapped back in when they are read. Segments are append-only and are deleted once all of their
+// blocks are dead. Lines are only dropped when the spill budget is used up too.
+//
+// Lines that were soft-wrapped at the right margin are joined with the next one into a logical line, which is
+// shown split again at the current width. Nothing is rewrapped when the width changes: a histogram of logical
+// line lengths gives the new row count right away, and rows are found by walking the line handles from an
+// anchor kept at the last row read, so only the rows scrolled into view are ever reflowed.
+//
+// The style ids the lines use are kept in memory per block, spilled or not, so the screen can tell which styles
+// are still needed without reading any line back.
+class Scrollback {
+  public:
+	static constexpr size_t BlockBytes = 1 << 20;
+	static constexpr size_t MaxLineCells = UINT16_MAX;
+	static constexpr uint32_t SegmentBlocks = 64;
+
+	// A spill budget of 0 keeps everything in memory
+	Scrollback(size_t budgetBytes, size_t spillBudgetBytes);
+	~Scrollback();
+	Scrollback(const Scrollback&) = delete;
+	Scrollback& operator=(const Scrollback&) = delete;
+
+	// Lines longer than MaxLineCells are cut. A wrapped line continues on the next one, its trailing blanks are
+	// part of the text and are kept
+	void push(const StyledChar* cells, size_t count, bool wrapped = false);
+	void clear();
+	// Spills or drops the oldest lines (and frees memory) until the scrollback fits, at least two blocks are
+	// always kept in memory
+	void setBudget(size_t budgetBytes);
+	void setSpillBudget(size_t spillBudgetBytes);
+
+	size_t size() const {
+		return count;
+	}
+
+	// Blocks and line handles currently in memory
+	size_t memoryUsed() const;
+
+	size_t spilledBytes() const {
+		return spilledBlocks * BlockBytes;
+	}
+
+	// Decodes line idx (0 is the oldest) into out and returns it, trailing blanks are not restored
+	StyledLine read(size_t idx, std::vector<StyledChar>& out) const;
+
+	// Removes the newest lines while they are wrapped, ie the start of a logical line that continues on the
+	// screen, and decodes them into out so the screen can reflow them with its first row
+	void takeOpenLine(std::vector<StyledChar>& out);
+
+	// Rows the scrollback takes with logical lines split at width
+	size_t rowCount(int width);
+	// Decodes row `row` (0 is the oldest) at width into out and returns it
+	StyledLine readRow(size_t row, int width, std::vector<StyledChar>& out);
+
+	// Whether a line still in the scrollback may use the style
+	bool usesStyle(uint32_t style) const {
+		return style < styleRefs.size() && styleRefs[style] > 0;
+	}
+
+  private:
+	static constexpr uint32_t NoBlock = UINT32_MAX;
+	static constexpr size_t NoLine = SIZE_MAX;
+	// Spilled blocks that stay mapped, reading around the same place doesn't remap every time
+	static constexpr int MappedBlocks = 8;
+
+	struct Line {
+		uint32_t block;
+		uint32_t offset;
+		uint16_t cells;
+		uint16_t runs;
+		bool wide;	  // codepoints are 4 bytes instead of 1
+		bool wrapped; // continues on the next line
+	};
+
+	// A style run is stored as its style id followed by its length
+	static constexpr size_t RunBytes = sizeof(uint32_t) + sizeof(uint16_t);
+
+	struct Block {
+		std::unique_ptr<unsigned char[]> bytes; // null when spilled or released
+		uint32_t liveLines = 0;
+		int32_t segment = -1; // set while the block is spilled
+		uint32_t slot = 0;	  // position in the segment, in blocks
+		std::vector<uint32_t> styles; // distinct style ids of its lines
+	};
+
+	struct Segment {
+		std::unique_ptr<platform::TempFile> file; // null once all of its blocks are dead
+		uint32_t written = 0;
+		uint32_t live = 0;
+	};
+
+	struct Mapping {
+		uint32_t block = NoBlock;
+		unsigned char* address = nullptr;
+	};
+
+	// A logical line and the number of rows before it at rowWidth
+	struct RowAnchor {
+		size_t line = NoLine; // absolute number of its first line
+		size_t rowsBefore = 0;
+	};
+
+	const Line& line(size_t idx) const;
+	// The block's data in memory, mapping it if it is spilled. nullptr if mapping failed
+	unsigned char* blockData(uint32_t block) const;
+	void popFront();
+	// Called when the last line of a block other than writeBlock is dropped
+	void retireBlock(uint32_t block);
+	// Makes writeBlock a block with nothing in it, spilling or dropping old lines if a new block would not fit
+	void startBlock();
+	// Writes the oldest block in memory to a segment and hands back its memory, nullptr if nothing was spilled
+	std::unique_ptr<unsigned char[]> spillOldest();
+	void unmapBlock(uint32_t block) const;
+	void closeSegments();
+	// Makes room in the handle ring for one more line
+	void reserveHandle();
+	void releaseFreeBlocks();
+	// Adds the style to the styles of writeBlock if it isn't there yet
+	void addStyle(uint32_t style);
+	// Adds or removes a logical line of that many cells from the length histogram and the row count
+	void countLogicalLine(size_t cells, bool add);
+	// Cells of the logical line starting at line idx, *last is set to its last line
+	size_t logicalLineCells(size_t idx, size_t* last) const;
+	size_t logicalLineStart(size_t idx) const;
+
+	static size_t rowsFor(size_t cells, int width) {
+		return cells == 0 || width <= 0 ? 1 : (cells + width - 1) / width;
+	}
+
+	std::vector<Block> blocks;
+	std::vector<uint32_t> freeBlocks;	  // empty and allocated
+	std::vector<uint32_t> releasedBlocks; // empty and without memory
+	std::deque<uint32_t> liveBlocks;	  // blocks holding lines, oldest first
+	std::vector<Line> lines;			  // ring of handles, the oldest at `first`
+	std::vector<Segment> segments;
+	mutable Mapping mappings[MappedBlocks];
+	mutable int nextMapping = 0;
+	size_t first = 0;
+	size_t count = 0;
+	size_t allocatedBlocks = 0;
+	size_t spilledBlocks = 0;
+	size_t budget;
+	size_t spillBudget;
+	uint32_t writeBlock = NoBlock;
+	uint32_t writeOffset = 0;
+
+	std::map<size_t, size_t> lineLengths; // logical line length in cells -> how many
+	size_t closedLines = 0;				  // lines that end a logical line, ie that are not wrapped
+	size_t frontCells = 0;				  // length of the oldest logical line, what is left of it
+	size_t backCells = 0;				  // length of the newest logical line
+	size_t dropped = 0;					  // lines dropped so far, makes indices absolute line numbers
+	int rowWidth = 0;
+	size_t totalRows = 0; // at rowWidth
+	RowAnchor anchor;
+	std::vector<StyledChar> rowCache; // the last logical line read
+	size_t rowCacheLine = NoLine;
+	std::vector<StyledChar> decodeScratch;
+
+	std::vector<uint32_t> styleRefs;	  // by style id, live blocks using it
+	std::vector<uint32_t> styleLastBlock; // by style id, the last block serial it was added to
+	uint32_t blockSerial = 0;			  // changes with writeBlock
+};
\ No newline at end of file
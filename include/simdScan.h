@@ -0,0 +1,10 @@
+#pragma once
+#include <cstddef>
+
+// Returns the index of the first byte that is not printable ASCII (a C0 control, DEL, ESC or any byte >= 0x80),
+// or len if the whole buffer is printable. Uses AVX2/SSE2 when the build targets them.
+size_t findNonPrintableAscii(const char* data, size_t len);
+
+// Returns the index of the first C0 control or DEL, or len if there is none. Bytes >= 0x80 are skipped over,
+// so this finds the end of a run of UTF-8 text.
+size_t findControlByte(const char* data, size_t len);
@@ -0,0 +1,92 @@
+#pragma once
+#include "bitflags.hpp"
+#include "span.hpp"
+#include <cstdint>
+
+enum class ColorKind : uint8_t {
+	Default, // the palette's default foreground or background, depending on where it is used
+	Indexed, // palette entry r
+	Rgb,
+};
+
+// A color as the application asked for it. Default and indexed colors are looked up in the live palette
+// when drawing, so changing the palette never touches the cells.
+struct TermColor {
+	ColorKind kind = ColorKind::Rgb;
+	unsigned char r;
+	unsigned char g;
+	unsigned char b;
+
+	constexpr TermColor() : r(0), g(0), b(0) {
+	}
+
+	constexpr TermColor(int r_, int g_, int b_)
+		: r(static_cast<unsigned char>(r_)), g(static_cast<unsigned char>(g_)), b(static_cast<unsigned char>(b_)) {
+	}
+
+	constexpr TermColor(unsigned char r_, unsigned char g_, unsigned char b_) : r(r_), g(g_), b(b_) {
+	}
+
+	constexpr TermColor(ColorKind kind_, unsigned char index) : kind(kind_), r(index), g(0), b(0) {
+	}
+
+	inline constexpr static TermColor Indexed(int index) {
+		return TermColor{ColorKind::Indexed, static_cast<unsigned char>(index)};
+	}
+
+	inline constexpr static TermColor DefaultBackGround() {
+		return TermColor{ColorKind::Default, 0};
+	}
+
+	inline constexpr static TermColor DefaultForeGround() {
+		return TermColor{ColorKind::Default, 0};
+	}
+
+	friend constexpr bool operator==(const TermColor& lhs, const TermColor& rhs) {
+		return lhs.kind == rhs.kind && lhs.r == rhs.r && lhs.g == rhs.g && lhs.b == rhs.b;
+	}
+
+	friend constexpr bool operator!=(const TermColor& lhs, const TermColor& rhs) {
+		return !(lhs == rhs);
+	}
+};
+
+struct TextAttribute {
+  public:
+	enum Value : uint8_t {
+		None = 0,
+		Bold = 1 << 0,
+		Italic = 1 << 1,
+		Underline = 1 << 2,
+		Inverse = 1 << 3,
+	};
+
+	DEFINE_BITFLAGS(TextAttribute);
+};
+
+// Colors and attributes of a cell, shared by all cells that look the same through a StyleTable
+struct CellStyle {
+	TermColor fg = TermColor::DefaultForeGround();
+	TermColor bg = TermColor::DefaultBackGround();
+	TextAttribute attr = TextAttribute::None;
+
+	uint64_t key() const {
+		return uint64_t(fg.r) | uint64_t(fg.g) << 8 | uint64_t(fg.b) << 16 | uint64_t(bg.r) << 24 |
+			   uint64_t(bg.g) << 32 | uint64_t(bg.b) << 40 | uint64_t(TextAttribute::Value(attr)) << 48 |
+			   uint64_t(fg.kind) << 56 | uint64_t(bg.kind) << 58;
+	}
+};
+
+struct StyledChar {
+	char32_t ch = U' '; // Unicode codepoint
+	uint32_t style = 0; // index in the screen's StyleTable, 0 is the default style
+
+	// A space in the default style, what trailing cells of a line can be trimmed to
+	bool isBlank() const {
+		return ch == U' ' && style == 0;
+	}
+};
+
+static_assert(sizeof(StyledChar) == 8, "cells are packed");
+
+using StyledLine = tcb::span<StyledChar>;
@@ -1,69 +1,40 @@
 #pragma once
-#include "bitflags.hpp"
-#include "span.hpp"
+#include "styledChar.h"
+#include "scrollback.h"
 #include <vector>
-#include <deque>
+#include <cstdint>
+#include <unordered_map>
 
-struct TermColor {
-	unsigned char r;
-	unsigned char g;
-	unsigned char b;
-
-	constexpr TermColor(int r_, int g_, int b_)
-		: r(static_cast<unsigned char>(r_)), g(static_cast<unsigned char>(g_)), b(static_cast<unsigned char>(b_)) {
-	}
-
-	constexpr TermColor(unsigned char r_, unsigned char g_, unsigned char b_) : r(r_), g(g_), b(b_) {
-	}
+// Interns every distinct CellStyle once and hands out stable ids for it, an id only changes meaning once it
+// is released
+class StyleTable {
+  public:
+	static constexpr uint32_t DefaultStyle = 0;
 
-	inline constexpr static TermColor DefaultBackGround() {
-		return TermColor{0, 0, 0};
+	StyleTable();
+	// Returns the id of `style`, adding it if needed
+	uint32_t intern(const CellStyle& style);
+	const CellStyle& get(uint32_t id) const {
+		return styles[id];
 	}
-
-	inline constexpr static TermColor DefaultForeGround() {
-		return TermColor{255, 255, 255};
+	// Styles interned and not released
+	size_t size() const {
+		return styles.size() - freeIds.size();
 	}
-
-	friend constexpr bool operator==(const TermColor& lhs, const TermColor& rhs) {
-		return lhs.r == rhs.r && lhs.g == rhs.g && lhs.b == rhs.b;
+	// One past the highest id handed out
+	size_t idLimit() const {
+		return styles.size();
 	}
+	// Lets intern hand out the id again. Ids not in use and DefaultStyle are ignored
+	void release(uint32_t id);
+	void clear();
 
-	friend constexpr bool operator!=(const TermColor& lhs, const TermColor& rhs) {
-		return !(lhs == rhs);
-	}
-};
-
-struct TextAttribute {
-  public:
-	enum Value : uint8_t {
-		None = 0,
-		Bold = 1 << 0,
-		Italic = 1 << 1,
-		Underline = 1 << 2,
-		Inverse = 1 << 3,
-	};
-
-	DEFINE_BITFLAGS(TextAttribute);
-};
-
-struct StyledChar {
-	char32_t ch = U' '; // Unicode codepoint
-	TermColor fg = TermColor::DefaultForeGround();
-	TermColor bg = TermColor::DefaultBackGround();
-	TextAttribute attr = TextAttribute::None;
-};
-
-struct ScreenState {
-	std::deque<std::vector<StyledChar>> scrollback;
-	std::vector<StyledChar> screen; // flattened, size = width * height
-	int cursorX;
-	int cursorY;
-	int width;
-	int height;
+  private:
+	std::vector<CellStyle> styles;
+	std::vector<uint32_t> freeIds;
+	std::unordered_map<uint64_t, uint32_t> ids;
 };
 
-using StyledLine = tcb::span<StyledChar>;
-
 class StyledScreen {
   public:
 	StyledScreen();
@@ -77,28 +48,143 @@ class StyledScreen {
 	int get_width() const;
 	int get_height() const;
 	int size() const;
-	StyledChar* data();
+	// The cell or row to write to, marks its row dirty. A row outside the screen is empty
 	StyledChar& atCursor();
+	StyledLine editRow(int y);
+	// Writes `count` ASCII characters with the current pen starting at the cursor, without moving it.
+	// The caller has to make sure they fit on the cursor's row.
+	void writeRun(const char* text, int count);
+	void writeRun(const char32_t* text, int count);
+	// Blanks columns from..to-1 of row y with the pen. A row erased to its end no longer wraps
+	void eraseCells(int y, int from, int to);
+	// Marks row y as soft-wrapped: its text continues on the next row. Cleared when the row is erased to its
+	// end or scrolled in blank
+	void setWrapped(int y);
+	bool isWrapped(int y) const;
+	// Moves the cursor down a row, scrolling the scroll region when it is on its bottom row
 	void newLine();
+	// Moves the cursor up a row, scrolling the scroll region down when it is on its top row
+	void reverseNewLine();
+	// Scroll the rows of the scroll region, rows scrolled off a full screen region go to scrollback
+	void scrollUp(int count);
+	void scrollDown(int count);
+	// Insert/delete blank rows at row y, pushing the rest of the scroll region down/up
+	void insertLines(int y, int count);
+	void deleteLines(int y, int count);
+	// Inclusive, 0-based. Invalid regions are ignored
+	void setScrollRegion(int top, int bottom);
+	int getScrollTop() const;
+	int getScrollBottom() const;
+	// Changes since the last clearDamage(), for consumers that redo only what changed. Rows scrolling with the
+	// whole screen are not marked dirty, they are reported as a scroll delta instead: move what was shown up by
+	// getScrollDelta() rows (down when negative) first, then redo the dirty rows
+	bool isRowDirty(int y) const {
+		return (dirtyRows[y >> 6] >> (y & 63)) & 1;
+	}
+	int getScrollDelta() const {
+		return scrollDelta;
+	}
+	void clearDamage();
+	// For changes to how every cell looks, like palette changes
+	void markAllDirty();
+
+	// Rows from scrollback are decoded into buffers owned by the screen, the spans are valid until the next call
 	std::vector<tcb::span<StyledChar>> getSnapshotView(int scrollbackOffset);
 
-	ScreenState getScreenState() const;
-	void setScreenState(const ScreenState& state);
+	// Switches between the primary and the alternate screen by swapping buffers, the alternate screen is
+	// cleared when entered. Nothing scrolls into scrollback while the alternate screen is active
+	void setAlternateScreen(bool alternate);
+	bool isAlternateScreen() const {
+		return alternateActive;
+	}
+	// Where the cursor was on the primary screen when the alternate one was entered, moved along when the
+	// primary screen is reflowed
+	void getPrimaryCursor(int& x, int& y) const {
+		x = primaryCursorX;
+		y = primaryCursorY;
+	}
+
+	// Style id for the given colors/attributes, it stays valid while a cell, the pen or the scrollback uses it
+	uint32_t internStyle(const CellStyle& style);
+	const CellStyle& getStyle(uint32_t id) const {
+		return styles.get(id);
+	}
 
-	inline size_t getScrollbackSize() const {
-		return scrollbackBuffer.size();
+	// In rows at the screen width
+	inline size_t getScrollbackSize() {
+		return scrollback.rowCount(cellsW);
 	}
 
-	static constexpr size_t MaxScrollbackLines = 1000;
+	// Past this many bytes of memory the oldest scrollback goes to temporary files, past the spill budget on
+	// top of that it is dropped
+	void setScrollbackBudget(size_t bytes);
+	void setScrollbackSpillBudget(size_t bytes);
+
+	static constexpr size_t DefaultScrollbackBytes = size_t(256) << 20;
+	static constexpr size_t DefaultScrollbackSpillBytes = size_t(4) << 30;
 
 	static std::string lineToString(const StyledLine& line);
 	static std::string lineToString(const std::vector<StyledChar>& line);
 
   private:
+	// Index in rowSlots of row y
+	int slotIndex(int y) const {
+		int i = rowHead + y;
+		return i < cellsH ? i : i - cellsH;
+	}
+	StyledChar* rowPtr(int y) const;
+	// Reallocates a buffer to the new size keeping what overlaps, its rows end up in order with the head at 0
+	void resizeBuffer(StyledChar*& cells, std::vector<int>& slots, int& head, std::vector<uint8_t>& wrapped,
+					  int width, int height);
+	// Like resizeBuffer, but rewraps the logical lines to the new width. Rows that don't fit above the cursor
+	// go to scrollback
+	void reflowBuffer(StyledChar*& cells, std::vector<int>& slots, int& head, std::vector<uint8_t>& wrapped,
+					  int width, int height, int& cursorX, int& cursorY);
+	void clearRow(int y);
+	// Rows outside the screen are ignored
+	void markDirty(int y) {
+		if (y < 0 || y >= cellsH) {
+			return;
+		}
+		dirtyRows[y >> 6] |= uint64_t(1) << (y & 63);
+	}
+	// Moves the dirty bits along with a scroll of the whole screen and adds it to the scroll delta
+	void shiftDirty(int count);
+	// Positive count scrolls rows top..bottom up, negative down
+	void scrollRows(int top, int bottom, int count);
+	// Reorders the slots of rows top..bottom so that row top + count comes first
+	void rotateRows(int top, int bottom, int count);
+	// Releases the styles that no cell, neither the pen nor the scrollback use anymore. Nothing is renumbered
+	void sweepStyles();
+
+	// Row y is stored in slot rowSlots[slotIndex(y)], a ring starting at rowHead. Scrolling the whole screen
+	// only moves the head and scrolling part of it reorders slot indices, both clear the rows that come in
+	// instead of moving cells
 	StyledChar* screen;
+	std::vector<int> rowSlots;
+	int rowHead = 0;
+	std::vector<uint8_t> slotWrapped; // by slot, so the flags move with the rows
+	// The inactive one of the primary and alternate screens, swapped with the above
+	StyledChar* otherScreen;
+	std::vector<int> otherRowSlots;
+	int otherRowHead = 0;
+	std::vector<uint8_t> otherSlotWrapped;
+	bool alternateActive = false;
+	int primaryCursorX = 0;
+	int primaryCursorY = 0;
 	int cellsW;
 	int cellsH;
-	std::deque<std::vector<StyledChar>> scrollbackBuffer;
+	int scrollTop = 0;
+	int scrollBottom = 0;
+	std::vector<uint64_t> dirtyRows; // bit per row on screen
+	int scrollDelta = 0;
+	StyleTable styles;
+	// Live styles past which unused ones are swept. Doubles what a sweep leaves, so sweeps that free little
+	// are rare
+	static constexpr size_t MinStyleSweep = 1 << 16;
+	size_t styleSweepAt = MinStyleSweep;
+	Scrollback scrollback;
+	std::vector<std::vector<StyledChar>> snapshotRows;
 };
 
 StyledChar makeStyledChar(char32_t ch);
\ No newline at end of file
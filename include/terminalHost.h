@@ -0,0 +1,21 @@
+#pragma once
+
+// Everything the terminal core needs from the window it is shown in.
+// The defaults behave like a focused window with no title bar and an empty clipboard, so temcore works without any frontend.
+class TerminalHost {
+  public:
+	virtual ~TerminalHost() = default;
+	virtual void setWindowTitle([[maybe_unused]] const char* title) {
+	}
+	// null-terminated UTF-8, or nullptr if there is nothing to paste
+	virtual const char* getClipboard() {
+		return nullptr;
+	}
+	virtual bool hasFocus() {
+		return true;
+	}
+};
+
+// The host is not owned, it has to outlive its use. Passing nullptr goes back to the headless default.
+void setTerminalHost(TerminalHost* host);
+TerminalHost& getTerminalHost();
@@ -1,7 +1,32 @@
 #pragma once
 #include <cstdint>
+#include <cstddef>
 #include <string_view>
-int decode_utf8(const char* s, char32_t* codepoint);
+
+// Partially decoded sequence, kept between calls so characters split across reads survive
+struct Utf8Decoder {
+	char32_t codepoint = 0;
+	uint8_t remaining = 0; // continuation bytes still expected
+	uint8_t lower = 0x80;  // valid range of the next continuation byte, narrower right after some lead bytes
+	uint8_t upper = 0xBF;
+
+	bool pending() const {
+		return remaining != 0;
+	}
+};
+
+constexpr char32_t ReplacementCharacter = 0xFFFD;
+
+// Decodes bytes into codepoints until either runs out, invalid input becomes U+FFFD.
+// Returns how many codepoints were written to out, *consumed is set to how many bytes were used.
+// An incomplete sequence at the end of data stays in `state` for the next call.
+size_t decode_utf8_stream(Utf8Decoder& state, const char* data, size_t len, char32_t* out, size_t outCap,
+						  size_t* consumed);
+// Drops a pending incomplete sequence, returns true if there was one (it should be shown as U+FFFD)
+bool reset_utf8_stream(Utf8Decoder& state);
+
+// Decodes a single codepoint from at most len bytes, returns the number of bytes used or 0 if invalid/truncated
+int decode_utf8(const char* s, size_t len, char32_t* codepoint);
 int encode_utf8(char32_t codepoint, char* out);
 int get_length(std::string_view sv);
-int codepoint_length(const char* s);
\ No newline at end of file
+int codepoint_length(const char* s);
@@ -0,0 +1,255 @@
+#pragma once
+#include <cstdint>
+
+// The DEC/ANSI escape sequence parser as a state machine, after Paul Williams' VT500 parser
+// (https://vt100.net/emu/dec_ansi_parser). The transition tables are generated at compile time,
+// so feeding a byte is a single lookup that gives the action to run and the next state.
+//
+// Differences from the original: C1 controls (0x80..0x9F) are not recognized, because in UTF-8 those bytes
+// are continuation bytes. Ground prints them (the UTF-8 decoder deals with them) and OSC keeps them so titles
+// can contain UTF-8. ':' is a parameter byte for CSI sub-parameters (SGR 38:2:r:g:b).
+
+enum class VtState : uint8_t {
+	Ground,
+	Escape,
+	EscapeIntermediate,
+	CsiEntry,
+	CsiParam,
+	CsiIntermediate,
+	CsiIgnore,
+	DcsEntry,
+	DcsParam,
+	DcsIntermediate,
+	DcsPassthrough,
+	DcsIgnore,
+	OscString,
+	SosPmApcString,
+	COUNT,
+};
+
+enum class VtAction : uint8_t {
+	None,
+	Ignore,
+	Print,
+	Execute,
+	Clear,
+	Collect,
+	Param,
+	EscDispatch,
+	CsiDispatch,
+	Hook,
+	Put,
+	Unhook,
+	OscStart,
+	OscPut,
+	OscEnd,
+	COUNT,
+};
+
+static_assert(static_cast<int>(VtState::COUNT) <= 16 && static_cast<int>(VtAction::COUNT) <= 16,
+			  "a transition is packed into one byte");
+
+struct VtTables {
+	// high nibble: action, low nibble: next state
+	uint8_t transitions[static_cast<int>(VtState::COUNT)][256];
+	VtAction onEntry[static_cast<int>(VtState::COUNT)];
+	VtAction onExit[static_cast<int>(VtState::COUNT)];
+
+	constexpr VtAction action(VtState state, uint8_t c) const {
+		return static_cast<VtAction>(transitions[static_cast<int>(state)][c] >> 4);
+	}
+
+	constexpr VtState next(VtState state, uint8_t c) const {
+		return static_cast<VtState>(transitions[static_cast<int>(state)][c] & 0x0F);
+	}
+};
+
+namespace vtDetail
+{
+constexpr void set(VtTables& t, VtState state, int from, int to, VtAction action, VtState next) {
+	for (int c = from; c <= to; ++c) {
+		t.transitions[static_cast<int>(state)][c] =
+			static_cast<uint8_t>((static_cast<int>(action) << 4) | static_cast<int>(next));
+	}
+}
+
+// Stays in the same state
+constexpr void stay(VtTables& t, VtState state, int from, int to, VtAction action) {
+	set(t, state, from, to, action, state);
+}
+
+// 0x00..0x17, 0x19, 0x1C..0x1F, everything in C0 that is not an "anywhere" transition
+constexpr void controls(VtTables& t, VtState state, VtAction action) {
+	stay(t, state, 0x00, 0x17, action);
+	stay(t, state, 0x19, 0x19, action);
+	stay(t, state, 0x1C, 0x1F, action);
+}
+
+constexpr VtTables buildVtTables() {
+	using S = VtState;
+	using A = VtAction;
+	VtTables t{};
+
+	for (int s = 0; s < static_cast<int>(S::COUNT); ++s) {
+		t.onEntry[s] = A::None;
+		t.onExit[s] = A::None;
+		stay(t, static_cast<S>(s), 0x00, 0xFF, A::Ignore);
+	}
+
+	t.onEntry[static_cast<int>(S::Escape)] = A::Clear;
+	t.onEntry[static_cast<int>(S::CsiEntry)] = A::Clear;
+	t.onEntry[static_cast<int>(S::DcsEntry)] = A::Clear;
+	t.onEntry[static_cast<int>(S::DcsPassthrough)] = A::Hook;
+	t.onExit[static_cast<int>(S::DcsPassthrough)] = A::Unhook;
+	t.onEntry[static_cast<int>(S::OscString)] = A::OscStart;
+	t.onExit[static_cast<int>(S::OscString)] = A::OscEnd;
+
+	// Ground
+	controls(t, S::Ground, A::Execute);
+	stay(t, S::Ground, 0x20, 0x7E, A::Print);
+	stay(t, S::Ground, 0x80, 0xFF, A::Print);
+
+	// Escape
+	controls(t, S::Escape, A::Execute);
+	set(t, S::Escape, 0x20, 0x2F, A::Collect, S::EscapeIntermediate);
+	set(t, S::Escape, 0x30, 0x7E, A::EscDispatch, S::Ground);
+	set(t, S::Escape, 'P', 'P', A::None, S::DcsEntry);
+	set(t, S::Escape, 'X', 'X', A::None, S::SosPmApcString);
+	set(t, S::Escape, '[', '[', A::None, S::CsiEntry);
+	set(t, S::Escape, ']', ']', A::None, S::OscString);
+	set(t, S::Escape, '^', '_', A::None, S::SosPmApcString);
+
+	controls(t, S::EscapeIntermediate, A::Execute);
+	stay(t, S::EscapeIntermediate, 0x20, 0x2F, A::Collect);
+	set(t, S::EscapeIntermediate, 0x30, 0x7E, A::EscDispatch, S::Ground);
+
+	// CSI
+	controls(t, S::CsiEntry, A::Execute);
+	set(t, S::CsiEntry, 0x20, 0x2F, A::Collect, S::CsiIntermediate);
+	set(t, S::CsiEntry, 0x30, 0x3B, A::Param, S::CsiParam);
+	set(t, S::CsiEntry, 0x3C, 0x3F, A::Collect, S::CsiParam); // private marker
+	set(t, S::CsiEntry, 0x40, 0x7E, A::CsiDispatch, S::Ground);
+
+	controls(t, S::CsiParam, A::Execute);
+	set(t, S::CsiParam, 0x20, 0x2F, A::Collect, S::CsiIntermediate);
+	stay(t, S::CsiParam, 0x30, 0x3B, A::Param);
+	set(t, S::CsiParam, 0x3C, 0x3F, A::None, S::CsiIgnore);
+	set(t, S::CsiParam, 0x40, 0x7E, A::CsiDispatch, S::Ground);
+
+	controls(t, S::CsiIntermediate, A::Execute);
+	stay(t, S::CsiIntermediate, 0x20, 0x2F, A::Collect);
+	set(t, S::CsiIntermediate, 0x30, 0x3F, A::None, S::CsiIgnore);
+	set(t, S::CsiIntermediate, 0x40, 0x7E, A::CsiDispatch, S::Ground);
+
+	controls(t, S::CsiIgnore, A::Execute);
+	set(t, S::CsiIgnore, 0x40, 0x7E, A::None, S::Ground);
+
+	// DCS, parsed so its payload can't leak onto the screen, the payload itself is dropped
+	set(t, S::DcsEntry, 0x20, 0x2F, A::Collect, S::DcsIntermediate);
+	set(t, S::DcsEntry, 0x30, 0x3B, A::Param, S::DcsParam);
+	set(t, S::DcsEntry, 0x3C, 0x3F, A::Collect, S::DcsParam);
+	set(t, S::DcsEntry, 0x40, 0x7E, A::None, S::DcsPassthrough);
+
+	set(t, S::DcsParam, 0x20, 0x2F, A::Collect, S::DcsIntermediate);
+	stay(t, S::DcsParam, 0x30, 0x3B, A::Param);
+	set(t, S::DcsParam, 0x3C, 0x3F, A::None, S::DcsIgnore);
+	set(t, S::DcsParam, 0x40, 0x7E, A::None, S::DcsPassthrough);
+
+	stay(t, S::DcsIntermediate, 0x20, 0x2F, A::Collect);
+	set(t, S::DcsIntermediate, 0x30, 0x3F, A::None, S::DcsIgnore);
+	set(t, S::DcsIntermediate, 0x40, 0x7E, A::None, S::DcsPassthrough);
+
+	controls(t, S::DcsPassthrough, A::Put);
+	stay(t, S::DcsPassthrough, 0x20, 0x7E, A::Put);
+	stay(t, S::DcsPassthrough, 0x80, 0xFF, A::Put);
+
+	// OSC, terminated by BEL (xterm) or ST (ESC \, through the anywhere ESC transition below)
+	stay(t, S::OscString, 0x20, 0x7E, A::OscPut);
+	stay(t, S::OscString, 0x80, 0xFF, A::OscPut);
+	set(t, S::OscString, 0x07, 0x07, A::None, S::Ground);
+
+	// SOS/PM/APC strings are ignored until ST, which is what the default Ignore already does
+
+	// Transitions that apply from anywhere
+	for (int s = 0; s < static_cast<int>(S::COUNT); ++s) {
+		set(t, static_cast<S>(s), 0x18, 0x18, A::Execute, S::Ground); // CAN
+		set(t, static_cast<S>(s), 0x1A, 0x1A, A::Execute, S::Ground); // SUB
+		set(t, static_cast<S>(s), 0x1B, 0x1B, A::None, S::Escape);
+	}
+
+	return t;
+}
+}
+
+inline constexpr VtTables vtTables = vtDetail::buildVtTables();
+
+// Parameters and intermediates of the CSI (or DCS) sequence being parsed, accumulated as the bytes arrive
+// so dispatching never has to re-parse text or allocate.
+struct CsiParams {
+	static constexpr int MaxParams = 32;
+	static constexpr int MaxValue = 65535;
+
+	uint16_t values[MaxParams];
+	uint32_t present = 0;	  // bit i: values[i] had digits, otherwise the handler's default applies
+	uint32_t subParams = 0;	  // bit i: values[i] came after a ':' and belongs to the parameter before it
+	uint8_t count = 0;		  // number of parameters seen, a trailing empty one included
+	char privateMarker = 0;	  // one of < = > ? or 0
+	char intermediate = 0;	  // first intermediate byte (0x20..0x2F) or 0
+	uint8_t intermediateCount = 0;
+	bool overflowed = false;
+
+	void clear() {
+		overflowed = false;
+		present = 0;
+		subParams = 0;
+		count = 0;
+		privateMarker = 0;
+		intermediate = 0;
+		intermediateCount = 0;
+	}
+
+	// 0-9, ';' or ':'
+	void param(char c) {
+		if (count == 0) {
+			values[0] = 0;
+			count = 1;
+		}
+		if (c == ';' || c == ':') {
+			if (count == MaxParams) {
+				overflowed = true; // extra parameters are dropped
+				return;
+			}
+			values[count] = 0;
+			if (c == ':')
+				subParams |= 1u << count;
+			count++;
+			return;
+		}
+		if (overflowed)
+			return;
+		int idx = count - 1;
+		int value = values[idx] * 10 + (c - '0');
+		values[idx] = static_cast<uint16_t>(value > MaxValue ? MaxValue : value);
+		present |= 1u << idx;
+	}
+
+	// Private markers (0x3C..0x3F) and intermediates (0x20..0x2F)
+	void collect(char c) {
+		if (c >= 0x3C) {
+			privateMarker = c;
+			return;
+		}
+		if (intermediateCount++ == 0)
+			intermediate = c;
+	}
+
+	int get(int idx, int defaultValue) const {
+		if (idx >= count || (present & (1u << idx)) == 0)
+			return defaultValue;
+		return values[idx];
+	}
+
+	bool isSubParam(int idx) const {
+		return idx < count && (subParams & (1u << idx)) != 0;
+	}
+};
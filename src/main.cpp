@@ -10,17 +10,64 @@
 #include "processOutput.h"
 #include "processInput.h"
 #include "styledScreen.h"
+#include "terminalHost.h"
 #include <cmath>
-Data o;
+#include <chrono>
+#include <algorithm>
+
+namespace
+{
+// Forwards the terminal's side effects to the glfw window
+class WindowHost : public TerminalHost {
+  public:
+	void setWindowTitle(const char* title) override {
+		platform::setWindowTitle(title);
+	}
+
+	const char* getClipboard() override {
+		return platform::getClipboard();
+	}
+
+	bool hasFocus() override {
+		return platform::hasFocused();
+	}
+};
+}
+
+static WindowHost windowHost;
 static platform::Process shell;
+static bool frameRendered = false;
+static bool firstFrame = true;
+static bool cursorWasVisible = false;
+static std::chrono::steady_clock::time_point blinkEpoch;
+
+static constexpr float CursorBlinkPeriod = 1.0f;  // seconds for a full on/off cycle
+static constexpr float KeyRepeatInterval = 0.035f; // matches the typed repeat in platform::internal::updateButton
 
-bool gameLogic(float deltaTime) {
+static float secondsSinceBlinkEpoch() {
+	return std::chrono::duration<float>(std::chrono::steady_clock::now() - blinkEpoch).count();
+}
+
+static bool isCursorVisible() {
+	if (!o.flags.has(TermFlags::SHOW_CURSOR))
+		return false;
+	if (!o.flags.has(TermFlags::CURSOR_BLINK))
+		return true;
+	return std::fmod(secondsSinceBlinkEpoch(), CursorBlinkPeriod) < CursorBlinkPeriod * 0.5f;
+}
+
+bool gameLogic([[maybe_unused]] float deltaTime) {
 	int screenW, screenH;
 	platform::getFrameBufferSize(&screenW, &screenH);
-	if (platform::isButtonPressed(platform::Button::F11))
+	// Without the event driven loop we present every vsync anyway, so always draw
+	bool changed = !EVENT_DRIVEN_LOOP || firstFrame || platform::hasRedrawBeenRequested();
+	if (platform::isButtonPressed(platform::Button::F11)) {
 		platform::setFullScreen(!platform::isFullScreen());
+		changed = true;
+	}
 
 	if (o.needResize) {
+		changed = true;
 		// for changing graphics mode modes
 		o.screen.resize(o.rows, o.cols);
 		shell.launch(o.rows, o.cols);
@@ -28,6 +75,7 @@ bool gameLogic(float deltaTime) {
 		o.needResize = false;
 	}
 	if (platform::hasWindowSizeChanged()) {
+		changed = true;
 		int w, h;
 		platform::getWindowSize(&w, &h);
 		o.cols = std::round(h / o.fontHeight);
@@ -37,38 +85,79 @@ bool gameLogic(float deltaTime) {
 	}
 
 	processInput();
-	shell.write(o.command.data(), o.command.size());
-	o.command.clear();
+	if (!o.command.empty()) {
+		changed = true; // typing snaps the view back to the bottom
+		shell.write(o.command.data(), o.command.size());
+		o.command.clear();
+	}
 
 	shell.update();
 	auto& buf = shell.getOutputBuffer();
 	if (!buf.empty()) {
+		changed = true;
 		processPartialOutputSegment(buf);
 		buf.clear();
 	}
 	int scroll = platform::getScrollLevel();
+	if (scroll != 0)
+		changed = true;
 	o.scrollbackOffset += scroll;
 	if (o.scrollbackOffset <= 0) {
 		o.scrollbackOffset = 0;
 	} else if (o.scrollbackOffset >= o.screen.getScrollbackSize()) {
 		o.scrollbackOffset = o.screen.getScrollbackSize() - 1;
 	}
-	auto lines = o.screen.getSnapshotView(o.scrollbackOffset);
-	render(lines, screenW, screenH);
-	if (o.flags.has(TermFlags::SHOW_CURSOR)) {
-		renderCursor(o.cursorX, o.cursorY + o.scrollbackOffset, deltaTime, screenW, screenH);
+	bool cursorVisible = isCursorVisible();
+	if (cursorVisible != cursorWasVisible) {
+		changed = true;
+		cursorWasVisible = cursorVisible;
+	}
+
+	frameRendered = changed;
+	if (changed) {
+		firstFrame = false;
+		auto lines = o.screen.getSnapshotView(o.scrollbackOffset);
+		render(lines, screenW, screenH);
+		if (cursorVisible) {
+			renderCursor(o.cursorX, o.cursorY + o.scrollbackOffset, screenW, screenH);
+		}
 	}
 	return shell.isRunning();
 }
 
+bool hasNewFrame() {
+	return frameRendered;
+}
+
+float getWaitTimeout() {
+	// Upper bound, so even a lost wakeup only stalls us briefly
+	float timeout = 1.0f;
+	if (o.flags.has(TermFlags::SHOW_CURSOR) && o.flags.has(TermFlags::CURSOR_BLINK)) {
+		float halfPeriod = CursorBlinkPeriod * 0.5f;
+		timeout = std::min(timeout, halfPeriod - std::fmod(secondsSinceBlinkEpoch(), halfPeriod));
+	}
+	// Held keys generate typed repeats from deltaTime, so keep ticking while one is down
+	platform::Button* buttons = platform::getAllButtons();
+	for (int i = 0; i < platform::Button::BUTTONS_COUNT; i++) {
+		if (buttons[i].held) {
+			timeout = std::min(timeout, KeyRepeatInterval);
+			break;
+		}
+	}
+	return std::max(timeout, 0.001f);
+}
+
 void closeGame() {
 	shell.terminate();
+	setTerminalHost(nullptr);
 	stopRender();
 }
 
 void startGame() {
 	o.cols = 25;
 	o.rows = 80;
+	blinkEpoch = std::chrono::steady_clock::now();
+	setTerminalHost(&windowHost);
 	startRender(); // loads the font, and sets o.fontWidth and o.fontHeight
 	o.screen.resize(o.rows, o.cols);
 	shell.launch(o.rows, o.cols);
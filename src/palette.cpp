@@ -0,0 +1,132 @@
+#include "palette.h"
+
+namespace
+{
+constexpr TermColor kBasicColors[16] = {
+	TermColor(0, 0, 0),		  // 0: black
+	TermColor(205, 0, 0),	  // 1: red
+	TermColor(0, 205, 0),	  // 2: green
+	TermColor(205, 205, 0),	  // 3: yellow
+	TermColor(0, 0, 238),	  // 4: blue
+	TermColor(205, 0, 205),	  // 5: magenta
+	TermColor(0, 205, 205),	  // 6: cyan
+	TermColor(229, 229, 229), // 7: white (light gray)
+	TermColor(127, 127, 127), // 8: bright black (dark gray)
+	TermColor(255, 0, 0),	  // 9: bright red
+	TermColor(0, 255, 0),	  // 10: bright green
+	TermColor(255, 255, 0),	  // 11: bright yellow
+	TermColor(92, 92, 255),	  // 12: bright blue
+	TermColor(255, 0, 255),	  // 13: bright magenta
+	TermColor(0, 255, 255),	  // 14: bright cyan
+	TermColor(255, 255, 255)  // 15: bright white
+};
+
+int hexDigit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// 1 to 4 hex digits scaled to 0..255, -1 if invalid
+int parseChannel(std::string_view digits) {
+	if (digits.empty() || digits.size() > 4)
+		return -1;
+	int value = 0;
+	for (char c : digits) {
+		int d = hexDigit(c);
+		if (d < 0)
+			return -1;
+		value = value * 16 + d;
+	}
+	int max = (1 << (4 * digits.size())) - 1;
+	return (value * 255 + max / 2) / max;
+}
+}
+
+Palette::Palette() {
+	reset();
+}
+
+void Palette::reset() {
+	for (int i = 0; i < Size; ++i) {
+		colors[i] = defaultColor(i);
+	}
+	foreground = DefaultForeground;
+	background = DefaultBackground;
+}
+
+void Palette::resetColor(int index) {
+	if (index >= 0 && index < Size) {
+		colors[index] = defaultColor(index);
+	}
+}
+
+TermColor Palette::resolve(TermColor color, bool foreground) const {
+	switch (color.kind) {
+	case ColorKind::Default:
+		return foreground ? this->foreground : background;
+	case ColorKind::Indexed:
+		return colors[color.r];
+	default:
+		return color;
+	}
+}
+
+TermColor Palette::defaultColor(int index) {
+	// 256-color xterm palette: 16..231 is a 6x6x6 color cube
+	constexpr int kColorLevels[6] = {0, 95, 135, 175, 215, 255};
+	if (index >= 16 && index <= 231) {
+		int idx = index - 16;
+		int r = kColorLevels[(idx / 36) % 6];
+		int g = kColorLevels[(idx / 6) % 6];
+		int b = kColorLevels[idx % 6];
+		return TermColor(r, g, b);
+	}
+	// 232..255: grayscale ramp
+	if (index >= 232 && index <= 255) {
+		int gray = 8 + (index - 232) * 10;
+		return TermColor(gray, gray, gray);
+	}
+	if (index >= 0 && index < 16)
+		return kBasicColors[index];
+	return TermColor(0, 0, 0);
+}
+
+bool parseColorSpec(std::string_view spec, TermColor* out) {
+	if (spec.substr(0, 4) == "rgb:") {
+		spec.remove_prefix(4);
+		size_t slash1 = spec.find('/');
+		size_t slash2 = slash1 == std::string_view::npos ? slash1 : spec.find('/', slash1 + 1);
+		if (slash2 == std::string_view::npos)
+			return false;
+		int r = parseChannel(spec.substr(0, slash1));
+		int g = parseChannel(spec.substr(slash1 + 1, slash2 - slash1 - 1));
+		int b = parseChannel(spec.substr(slash2 + 1));
+		if (r < 0 || g < 0 || b < 0)
+			return false;
+		*out = TermColor(r, g, b);
+		return true;
+	}
+	if (!spec.empty() && spec[0] == '#' && (spec.size() == 4 || spec.size() == 7)) {
+		// unlike rgb:, the digits are the high bits of each channel (#3a7 is #30a070)
+		size_t digits = (spec.size() - 1) / 3;
+		int channels[3];
+		for (int i = 0; i < 3; ++i) {
+			int value = 0;
+			for (size_t d = 0; d < digits; ++d) {
+				int digit = hexDigit(spec[1 + i * digits + d]);
+				if (digit < 0)
+					return false;
+				value = value * 16 + digit;
+			}
+			channels[i] = digits == 1 ? value << 4 : value;
+		}
+		*out = TermColor(channels[0], channels[1], channels[2]);
+		return true;
+	}
+	return false;
+}
@@ -23,146 +23,6 @@ bool fullScreen = false;
 bool mouseMovedFlag = 0;
 }
 
-#pragma region input
-
-namespace
-{
-platform::Button keyBoard[platform::Button::BUTTONS_COUNT];
-platform::Button leftMouse;
-platform::Button rightMouse;
-
-std::u32string typedInput;
-int scrollLevel = 0;
-std::vector<platform::SpecialInputEvent> specialInputEvent;
-}
-
-namespace platform
-{
-
-int getScrollLevel() {
-	return scrollLevel;
-}
-
-std::vector<SpecialInputEvent>& getSpecialInput() {
-	using namespace platform;
-	return specialInputEvent;
-}
-
-Button* getAllButtons() {
-	return keyBoard;
-}
-
-const Button& getLMouseButton() {
-	return leftMouse;
-}
-
-const Button& getRMouseButton() {
-	return rightMouse;
-}
-
-int isButtonHeld(int key) {
-	if (key < Button::A || key >= Button::BUTTONS_COUNT) {
-		return 0;
-	}
-
-	return keyBoard[key].held;
-}
-
-int isButtonPressed(int key) {
-	if (key < Button::A || key >= Button::BUTTONS_COUNT) {
-		return 0;
-	}
-
-	return keyBoard[key].pressed;
-}
-
-int isButtonReleased(int key) {
-	if (key < Button::A || key >= Button::BUTTONS_COUNT) {
-		return 0;
-	}
-
-	return keyBoard[key].released;
-}
-
-int isButtonTyped(int key) {
-	if (key < Button::A || key >= Button::BUTTONS_COUNT) {
-		return 0;
-	}
-
-	return keyBoard[key].typed;
-}
-
-int isLMousePressed() {
-	return leftMouse.pressed;
-}
-
-int isRMousePressed() {
-	return rightMouse.pressed;
-}
-
-int isLMouseReleased() {
-	return leftMouse.released;
-}
-
-int isRMouseReleased() {
-	return rightMouse.released;
-}
-
-int isLMouseHeld() {
-	return leftMouse.held;
-}
-
-int isRMouseHeld() {
-	return rightMouse.held;
-}
-
-const std::u32string& getTypedInput() {
-	return typedInput;
-}
-
-void internal::setButtonState(int button, int newState) {
-	processEventButton(keyBoard[button], newState);
-}
-
-void internal::setLeftMouseState(int newState) {
-	processEventButton(leftMouse, newState);
-}
-
-void internal::setRightMouseState(int newState) {
-	processEventButton(rightMouse, newState);
-}
-
-void internal::updateAllButtons(float deltaTime) {
-	for (int i = 0; i < Button::BUTTONS_COUNT; i++) {
-		updateButton(keyBoard[i], deltaTime);
-	}
-
-	updateButton(leftMouse, deltaTime);
-	updateButton(rightMouse, deltaTime);
-}
-
-void internal::resetInputsToZero() {
-	resetTypedInput();
-
-	for (int i = 0; i < Button::BUTTONS_COUNT; i++) {
-		resetButtonToZero(keyBoard[i]);
-	}
-
-	resetButtonToZero(leftMouse);
-	resetButtonToZero(rightMouse);
-}
-
-void internal::addToTypedInput(char32_t c) {
-	typedInput += c;
-}
-
-void internal::resetTypedInput() {
-	typedInput.clear();
-	specialInputEvent.clear();
-}
-}
-
-#pragma endregion
 #pragma region callbacks
 
 namespace
@@ -276,7 +136,7 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 				mod = (platform::Modifier)((uint8_t)mod | (uint8_t)platform::Modifier::Ctrl);
 			if (alt)
 				mod = (platform::Modifier)((uint8_t)mod | (uint8_t)platform::Modifier::Alt);
-			specialInputEvent.push_back({mod, codepoint});
+			platform::internal::addSpecialInput({mod, codepoint});
 		}
 	}
 }
@@ -311,6 +171,7 @@ void windowFocusCallback(GLFWwindow* window, int focused) {
 }
 
 static bool hasBeinResized = false;
+static bool redrawRequested = false;
 
 void windowSizeCallback(GLFWwindow* window, int x, int y) {
 	platform::internal::resetInputsToZero();
@@ -318,6 +179,10 @@ void windowSizeCallback(GLFWwindow* window, int x, int y) {
 	hasBeinResized = true;
 }
 
+void windowRefreshCallback(GLFWwindow* window) {
+	redrawRequested = true;
+}
+
 void cursorPositionCallback(GLFWwindow* window, double xpos, double ypos) {
 	mouseMovedFlag = true;
 }
@@ -327,7 +192,7 @@ void characterCallback(GLFWwindow* window, unsigned int codepoint) {
 }
 
 void scrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
-	scrollLevel = yoffset;
+	platform::internal::setScrollLevel(yoffset);
 }
 }
 
@@ -409,6 +274,14 @@ void setWindowTitle(const char* title) {
 	glfwSetWindowTitle(wind, title);
 }
 
+bool hasRedrawBeenRequested() {
+	return redrawRequested;
+}
+
+void wakeUpEventLoop() {
+	glfwPostEmptyEvent();
+}
+
 };
 
 #pragma endregion
@@ -450,6 +323,7 @@ int main() {
 	glfwSetMouseButtonCallback(wind, mouseCallback);
 	glfwSetWindowFocusCallback(wind, windowFocusCallback);
 	glfwSetWindowSizeCallback(wind, windowSizeCallback);
+	glfwSetWindowRefreshCallback(wind, windowRefreshCallback);
 	glfwSetCursorPosCallback(wind, cursorPositionCallback);
 	glfwSetCharCallback(wind, characterCallback);
 	glfwSetScrollCallback(wind, scrollCallback);
@@ -508,14 +382,22 @@ int main() {
 			}
 		}
 
-		scrollLevel = 0;
+		platform::internal::setScrollLevel(0);
 		mouseMovedFlag = false;
 		hasBeinResized = false;
+		redrawRequested = false;
 		platform::internal::updateAllButtons(deltaTime);
 		platform::internal::resetTypedInput();
 
+#if EVENT_DRIVEN_LOOP
+		// Sleep until input, pty output (see platform::wakeUpEventLoop) or the next cursor blink
+		if (hasNewFrame())
+			glfwSwapBuffers(wind);
+		glfwWaitEventsTimeout(getWaitTimeout());
+#else
 		glfwSwapBuffers(wind);
 		glfwPollEvents();
+#endif
 	}
 	closeGame();
 	glfwTerminate();
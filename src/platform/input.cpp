@@ -0,0 +1,150 @@
+// Input state, filled in by whatever frontend is running (glfwMain.cpp) and read by processInput.
+// No window system in here so it can be part of temcore.
+#include "platform/input.h"
+#include <string>
+#include <vector>
+
+namespace
+{
+platform::Button keyBoard[platform::Button::BUTTONS_COUNT];
+platform::Button leftMouse;
+platform::Button rightMouse;
+
+std::u32string typedInput;
+int scrollLevel = 0;
+std::vector<platform::SpecialInputEvent> specialInputEvent;
+}
+
+namespace platform
+{
+
+int getScrollLevel() {
+	return scrollLevel;
+}
+
+std::vector<SpecialInputEvent>& getSpecialInput() {
+	using namespace platform;
+	return specialInputEvent;
+}
+
+Button* getAllButtons() {
+	return keyBoard;
+}
+
+const Button& getLMouseButton() {
+	return leftMouse;
+}
+
+const Button& getRMouseButton() {
+	return rightMouse;
+}
+
+int isButtonHeld(int key) {
+	if (key < Button::A || key >= Button::BUTTONS_COUNT) {
+		return 0;
+	}
+
+	return keyBoard[key].held;
+}
+
+int isButtonPressed(int key) {
+	if (key < Button::A || key >= Button::BUTTONS_COUNT) {
+		return 0;
+	}
+
+	return keyBoard[key].pressed;
+}
+
+int isButtonReleased(int key) {
+	if (key < Button::A || key >= Button::BUTTONS_COUNT) {
+		return 0;
+	}
+
+	return keyBoard[key].released;
+}
+
+int isButtonTyped(int key) {
+	if (key < Button::A || key >= Button::BUTTONS_COUNT) {
+		return 0;
+	}
+
+	return keyBoard[key].typed;
+}
+
+int isLMousePressed() {
+	return leftMouse.pressed;
+}
+
+int isRMousePressed() {
+	return rightMouse.pressed;
+}
+
+int isLMouseReleased() {
+	return leftMouse.released;
+}
+
+int isRMouseReleased() {
+	return rightMouse.released;
+}
+
+int isLMouseHeld() {
+	return leftMouse.held;
+}
+
+int isRMouseHeld() {
+	return rightMouse.held;
+}
+
+const std::u32string& getTypedInput() {
+	return typedInput;
+}
+
+void internal::setButtonState(int button, int newState) {
+	processEventButton(keyBoard[button], newState);
+}
+
+void internal::setLeftMouseState(int newState) {
+	processEventButton(leftMouse, newState);
+}
+
+void internal::setRightMouseState(int newState) {
+	processEventButton(rightMouse, newState);
+}
+
+void internal::updateAllButtons(float deltaTime) {
+	for (int i = 0; i < Button::BUTTONS_COUNT; i++) {
+		updateButton(keyBoard[i], deltaTime);
+	}
+
+	updateButton(leftMouse, deltaTime);
+	updateButton(rightMouse, deltaTime);
+}
+
+void internal::resetInputsToZero() {
+	resetTypedInput();
+
+	for (int i = 0; i < Button::BUTTONS_COUNT; i++) {
+		resetButtonToZero(keyBoard[i]);
+	}
+
+	resetButtonToZero(leftMouse);
+	resetButtonToZero(rightMouse);
+}
+
+void internal::addToTypedInput(char32_t c) {
+	typedInput += c;
+}
+
+void internal::addSpecialInput(SpecialInputEvent e) {
+	specialInputEvent.push_back(e);
+}
+
+void internal::setScrollLevel(int level) {
+	scrollLevel = level;
+}
+
+void internal::resetTypedInput() {
+	typedInput.clear();
+	specialInputEvent.clear();
+}
+}
@@ -3,7 +3,9 @@
 #include <string_view>
 #include <stdexcept>
 #include <platform/tools.h>
+#include <platform/window.h>
 #include <stdio.h>
+#include <chrono>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -14,6 +16,7 @@ namespace platform
 {
 
 void Process::launch(int rows, int cols) {
+	terminate();
 	std::string_view cmd = "cmd.exe /Q /K";
 	HANDLE hInputRead = nullptr;
 	HANDLE hOutputWrite = nullptr;
@@ -50,36 +53,35 @@ void Process::launch(int rows, int cols) {
 	CloseHandle(pi.hThread);
 	hProcess = pi.hProcess;
 	buffer.reserve(4096);
+	startReader();
 }
 
 Process::~Process() {
 	terminate();
 }
 
-void Process::write(const char* data, size_t len) {
-	DWORD written = 0;
-	WriteFile(hInputWrite, data, (DWORD)len, &written, nullptr);
-}
-
-void Process::update() {
-	DWORD available = 0;
-	if (!PeekNamedPipe(hOutputRead, nullptr, 0, nullptr, &available, nullptr))
-		return;
-	if (available == 0)
-		return;
-
-	size_t oldSize = buffer.size();
-	buffer.resize(oldSize + available);
-	DWORD read = 0;
-	if (ReadFile(hOutputRead, buffer.data() + oldSize, available, &read, nullptr)) {
-		buffer.resize(oldSize + read);
-	} else {
-		buffer.resize(oldSize); // rollback
+void Process::readerLoop() {
+	char temp[16384];
+	while (true) {
+		// Blocks until the console writes something, fails once the pseudo console is closed
+		DWORD read = 0;
+		if (!ReadFile(hOutputRead, temp, sizeof(temp), &read, nullptr) || read == 0)
+			break;
+		size_t written = 0;
+		// When stopping the data is dropped, but we keep reading so ClosePseudoConsole can't block on a full pipe
+		while (written < read && !stopReader.load(std::memory_order_relaxed)) {
+			written += pending.write(temp + written, read - written);
+			notifyOutput();
+			if (written < read)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
 	}
+	notifyOutput(); // let the main loop notice the console went away
 }
 
-std::vector<char>& Process::getOutputBuffer() {
-	return buffer;
+void Process::write(const char* data, size_t len) {
+	DWORD written = 0;
+	WriteFile(hInputWrite, data, (DWORD)len, &written, nullptr);
 }
 
 bool Process::isRunning() const {
@@ -91,10 +93,13 @@ bool Process::isRunning() const {
 }
 
 void Process::terminate() {
+	stopReader = true;
 	if (hProcess)
 		TerminateProcess(hProcess, 0);
 	if (hPC)
 		ClosePseudoConsole(hPC);
+	// Closing the pseudo console breaks the pipe, which wakes the reader out of ReadFile
+	joinReader();
 	if (hInputWrite)
 		CloseHandle(hInputWrite);
 	if (hOutputRead)
@@ -123,11 +128,14 @@ void Process::resize(int columns, int rows) {
 #include <sys/wait.h>
 #include <csignal>
 #include <cstring>
+#include <cerrno>
+#include <poll.h>
 #include <pty.h>
 
 namespace platform
 {
 void Process::launch(int rows, int cols) {
+	terminate();
 	std::string_view cmd = "/bin/bash";
 	struct winsize ws = {cols, rows - 1, 0, 0}; // fake terminal size
 	pid = forkpty(&masterFd, nullptr, nullptr, &ws);
@@ -147,26 +155,39 @@ void Process::launch(int rows, int cols) {
 	int status;
 	pid_t result = waitpid(pid, &status, WNOHANG);
 	permaAssertComment(result == 0, "Process exited early");
+	startReader();
 }
 
 Process::~Process() {
 	terminate();
 }
 
-void Process::write(const char* data, size_t len) {
-	::write(masterFd, data, len);
-}
-
-void Process::update() {
-	char temp[1024];
-	ssize_t count = ::read(masterFd, temp, sizeof(temp));
-	if (count > 0) {
-		buffer.insert(buffer.end(), temp, temp + count);
+void Process::readerLoop() {
+	char temp[16384];
+	pollfd pfd{masterFd, POLLIN, 0};
+	while (!stopReader.load(std::memory_order_relaxed)) {
+		size_t space = pending.capacity() - pending.size();
+		if (space == 0) {
+			// The main thread is behind, give it a moment to drain
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		// Timeout so `terminate()` never waits long for the thread to notice `stopReader`
+		if (poll(&pfd, 1, 50) <= 0)
+			continue;
+		ssize_t count = ::read(masterFd, temp, std::min(sizeof(temp), space));
+		if (count > 0) {
+			pending.write(temp, count);
+			notifyOutput();
+		} else if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+			break; // EIO once the child has exited and the slave side is closed
+		}
 	}
+	notifyOutput(); // let the main loop notice the shell exited
 }
 
-std::vector<char>& Process::getOutputBuffer() {
-	return buffer;
+void Process::write(const char* data, size_t len) {
+	::write(masterFd, data, len);
 }
 
 bool Process::isRunning() const {
@@ -179,6 +200,7 @@ bool Process::isRunning() const {
 void Process::terminate() {
 	if (pid != -1)
 		kill(pid, SIGTERM);
+	joinReader();
 	if (masterFd != -1)
 		close(masterFd);
 	masterFd = -1;
@@ -198,3 +220,41 @@ void Process::resize(int rows, int columns) {
 } // namespace platform
 
 #endif
+
+namespace platform
+{
+void Process::startReader() {
+	pending.reset();
+	stopReader = false;
+	wakePosted = false;
+	reader = std::thread(&Process::readerLoop, this);
+}
+
+void Process::joinReader() {
+	stopReader = true;
+	if (reader.joinable())
+		reader.join();
+}
+
+void Process::notifyOutput() {
+	// One wakeup per frame is enough, the main loop drains everything at once
+	if (!wakePosted.exchange(true, std::memory_order_acq_rel))
+		platform::wakeUpEventLoop();
+}
+
+void Process::update() {
+	wakePosted.store(false, std::memory_order_release);
+	size_t available = pending.size();
+	if (available == 0)
+		return;
+
+	size_t oldSize = buffer.size();
+	buffer.resize(oldSize + available);
+	size_t read = pending.read(buffer.data() + oldSize, available);
+	buffer.resize(oldSize + read);
+}
+
+std::vector<char>& Process::getOutputBuffer() {
+	return buffer;
+}
+} // namespace platform
@@ -0,0 +1,147 @@
+#include <platform/tempFile.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+
+namespace platform
+{
+
+bool TempFile::open() {
+	close();
+	char dir[MAX_PATH];
+	char path[MAX_PATH];
+	if (!GetTempPathA(MAX_PATH, dir) || !GetTempFileNameA(dir, "tem", 0, path)) {
+		return false;
+	}
+	HANDLE handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+								FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+	if (handle == INVALID_HANDLE_VALUE) {
+		DeleteFileA(path);
+		return false;
+	}
+	file = handle;
+	return true;
+}
+
+void TempFile::close() {
+	if (file) {
+		CloseHandle(file);
+		file = nullptr;
+	}
+}
+
+bool TempFile::isOpen() const {
+	return file != nullptr;
+}
+
+bool TempFile::write(uint64_t offset, const void* data, size_t size) {
+	const char* bytes = static_cast<const char*>(data);
+	while (size > 0) {
+		OVERLAPPED position{};
+		position.Offset = static_cast<DWORD>(offset);
+		position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		DWORD written = 0;
+		DWORD chunk = size > (1u << 30) ? (1u << 30) : static_cast<DWORD>(size);
+		if (!WriteFile(file, bytes, chunk, &written, &position) || written == 0) {
+			return false;
+		}
+		bytes += written;
+		offset += written;
+		size -= written;
+	}
+	return true;
+}
+
+void* TempFile::map(uint64_t offset, size_t size) {
+	// Size 0 maps the whole file as it is now, the view keeps the mapping alive after the handle is closed
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	if (!mapping) {
+		return nullptr;
+	}
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, static_cast<DWORD>(offset >> 32),
+							   static_cast<DWORD>(offset), size);
+	CloseHandle(mapping);
+	return view;
+}
+
+void TempFile::unmap(void* address, size_t size) {
+	UnmapViewOfFile(address);
+}
+}
+
+#else
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+
+namespace platform
+{
+
+bool TempFile::open() {
+	close();
+	const char* dir = getenv("TMPDIR");
+	if (!dir || !*dir) {
+		dir = "/tmp";
+	}
+	std::string path = std::string(dir) + "/tem-XXXXXX";
+	fd = mkstemp(path.data());
+	if (fd < 0) {
+		return false;
+	}
+	unlink(path.c_str());
+	return true;
+}
+
+void TempFile::close() {
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+bool TempFile::isOpen() const {
+	return fd >= 0;
+}
+
+bool TempFile::write(uint64_t offset, const void* data, size_t size) {
+	const char* bytes = static_cast<const char*>(data);
+	while (size > 0) {
+		ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return false;
+		}
+		bytes += written;
+		offset += written;
+		size -= written;
+	}
+	return true;
+}
+
+void* TempFile::map(uint64_t offset, size_t size) {
+	void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, static_cast<off_t>(offset));
+	return address == MAP_FAILED ? nullptr : address;
+}
+
+void TempFile::unmap(void* address, size_t size) {
+	munmap(address, size);
+}
+}
+
+#endif
+
+namespace platform
+{
+
+TempFile::~TempFile() {
+	close();
+}
+}
@@ -2,7 +2,7 @@
 #include "main.h"
 #include <string>
 #include <platform/input.h>
-#include <platform/window.h>
+#include "terminalHost.h"
 #include "utf8.h"
 
 void processInput() {
@@ -43,7 +43,7 @@ void processInput() {
 
 	if ((platform::isButtonHeld(platform::Button::LeftCtrl) || platform::isButtonPressed(platform::Button::LeftCtrl)) &&
 		platform::isButtonPressed(platform::Button::V)) {
-		const char* clip = platform::getClipboard(); // null-terminated UTF-8
+		const char* clip = getTerminalHost().getClipboard(); // null-terminated UTF-8
 		if (clip) {
 			if (o.flags.has(TermFlags::BRACKETED_PASTE)) {
 				o.command += "\x1b[200~"; // Start bracketed paste
@@ -72,8 +72,8 @@ void processInput() {
 	}
 
 	if (o.flags.has(TermFlags::TRACK_FOCUS)) {
-		static bool wasFocused = platform::hasFocused();
-		bool isFocused = platform::hasFocused();
+		static bool wasFocused = getTerminalHost().hasFocus();
+		bool isFocused = getTerminalHost().hasFocus();
 		if (isFocused != wasFocused) {
 			wasFocused = isFocused;
 			std::string_view focusCode = isFocused ? "\033[I" : "\033[O";
@@ -8,38 +8,17 @@
 #include <string>
 #include <cstdio>
 #include <cstring>
-#include <platform/window.h>
+#include "terminalHost.h"
+#include "simdScan.h"
+#include "vtParser.h"
+#include "palette.h"
 #include <charconv>
-#include <stdexcept>
+#include <iterator>
 #include "styledScreen.h"
 #include <platform/tools.h>
 
-namespace std
-{
-static int stoi(std::string_view sv) {
-	int out;
-	if (sv.empty() || sv.data()[0] == '\0') {
-		throw std::runtime_error("stoi failed");
-	}
-	const std::from_chars_result result = std::from_chars(sv.data(), sv.data() + sv.size(), out);
-	if (result.ec == std::errc::invalid_argument || result.ec == std::errc::result_out_of_range) {
-		throw std::runtime_error("stoi failed");
-	}
-	return out;
-}
-
-static int stoi(std::string_view sv, int defaultVal) {
-	int out;
-	if (sv.empty() || sv.data()[0] == '\0') {
-		return defaultVal;
-	}
-	const std::from_chars_result result = std::from_chars(sv.data(), sv.data() + sv.size(), out);
-	if (result.ec == std::errc::invalid_argument || result.ec == std::errc::result_out_of_range) {
-		throw std::runtime_error("stoi failed");
-	}
-	return out;
-}
-}
+// Shared by the parser, the screen model and the input encoder
+Data o;
 
 namespace
 {
@@ -51,77 +30,67 @@ static void setFlag(TermFlags::Value flag, bool enable) {
 	}
 };
 
-std::vector<std::string_view> split(const std::string_view& str, char delimiter) {
-	std::vector<std::string_view> parts;
-	size_t start = 0;
-	while (true) {
-		size_t pos = str.find(delimiter, start);
-		if (pos == std::string_view::npos) {
-			parts.emplace_back(str.substr(start));
-			break;
-		}
-		parts.emplace_back(str.substr(start, pos - start));
-		start = pos + 1;
-	}
-	return parts;
-}
-
-constexpr TermColor kBasicColors[16] = {
-	TermColor(0, 0, 0),		  // 0: black
-	TermColor(205, 0, 0),	  // 1: red
-	TermColor(0, 205, 0),	  // 2: green
-	TermColor(205, 205, 0),	  // 3: yellow
-	TermColor(0, 0, 238),	  // 4: blue
-	TermColor(205, 0, 205),	  // 5: magenta
-	TermColor(0, 205, 205),	  // 6: cyan
-	TermColor(229, 229, 229), // 7: white (light gray)
-	TermColor(127, 127, 127), // 8: bright black (dark gray)
-	TermColor(255, 0, 0),	  // 9: bright red
-	TermColor(0, 255, 0),	  // 10: bright green
-	TermColor(255, 255, 0),	  // 11: bright yellow
-	TermColor(92, 92, 255),	  // 12: bright blue
-	TermColor(255, 0, 255),	  // 13: bright magenta
-	TermColor(0, 255, 255),	  // 14: bright cyan
-	TermColor(255, 255, 255)  // 15: bright white
-};
+// DECSC/DECRC, to the slot of the screen that is active
+void saveCursor() {
+	SavedCursor& saved = o.savedCursors[o.screen.isAlternateScreen()];
+	saved.x = o.cursorX;
+	saved.y = o.cursorY;
+}
 
-TermColor colorFrom256(int index) {
-	// 256-color xterm palette: 16..231 is a 6x6x6 color cube
-	// index: 0-255
-	constexpr int kColorLevels[6] = {0, 95, 135, 175, 215, 255};
-	if (index >= 16 && index <= 231) {
-		int idx = index - 16;
-		int r = kColorLevels[(idx / 36) % 6];
-		int g = kColorLevels[(idx / 6) % 6];
-		int b = kColorLevels[idx % 6];
-		return TermColor(r, g, b);
-	}
-	// 232..255: grayscale ramp
-	if (index >= 232 && index <= 255) {
-		int gray = 8 + (index - 232) * 10;
-		return TermColor(gray, gray, gray);
-	}
-	// 0..15: standard colors (fallback to simple mapping)
-	if (index >= 0 && index < 16)
-		return kBasicColors[index];
-	// fallback: black
-	return TermColor(0, 0, 0);
-}
-
-void applySGRColor(std::string_view codeStr) {
-	auto codes = split(codeStr, ';');
-
-	for (size_t i = 0; i < codes.size(); ++i) {
-		int code = 0;
-		try {
-			if (codes[i].empty()) {
-				code = 0; // Default code
-			} else {
-				code = std::stoi(codes[i]);
-			}
-		} catch (...) {
-			continue;
+void restoreCursor() {
+	const SavedCursor& saved = o.savedCursors[o.screen.isAlternateScreen()];
+	o.cursorX = std::min(saved.x, o.screen.get_width() - 1);
+	o.cursorY = std::min(saved.y, o.screen.get_height() - 1);
+}
+
+// Reads the color after a 38/48 starting at params[i], either as sub-parameters (38:5:n, 38:2:cs:r:g:b,
+// 38:2:r:g:b) or the older ';' form (38;5;n, 38;2;r;g;b). Returns the index of the last parameter used.
+int parseExtendedColor(const CsiParams& params, int i, TermColor* out, bool* found) {
+	*found = false;
+	if (params.isSubParam(i + 1)) {
+		int last = i + 1;
+		while (params.isSubParam(last + 1)) {
+			last++;
+		}
+		int mode = params.get(i + 1, 0);
+		int subCount = last - i;
+		if (mode == 5 && subCount >= 2) {
+			*out = TermColor::Indexed(params.get(i + 2, 0));
+			*found = true;
+		} else if (mode == 2 && subCount >= 4) {
+			// with 5 sub parameters the first one after the mode is the (ignored) color space id
+			int first = subCount >= 5 ? i + 3 : i + 2;
+			*out = TermColor(params.get(first, 0), params.get(first + 1, 0), params.get(first + 2, 0));
+			*found = true;
+		}
+		return last;
+	}
+
+	int mode = params.get(i + 1, 0);
+	if (mode == 5 && i + 2 < params.count) {
+		// 256-color mode
+		*out = TermColor::Indexed(params.get(i + 2, 0));
+		*found = true;
+		return i + 2;
+	}
+	if (mode == 2 && i + 4 < params.count) {
+		// Truecolor mode
+		*out = TermColor(params.get(i + 2, 0), params.get(i + 3, 0), params.get(i + 4, 0));
+		*found = true;
+		return i + 4;
+	}
+	return std::min(i + 1, params.count - 1);
+}
+
+void applySGR(const CsiParams& params) {
+	// CSI m is the same as CSI 0 m
+	int count = std::max<int>(params.count, 1);
+
+	for (int i = 0; i < count; ++i) {
+		if (params.isSubParam(i)) {
+			continue; // sub parameters of something we don't support, like 4:3 (curly underline)
 		}
+		int code = params.get(i, 0);
 
 		switch (code) {
 		case 0:
@@ -158,28 +127,14 @@ void applySGRColor(std::string_view codeStr) {
 			continue;
 		case 38:
 		case 48: {
-			bool isForeground = (code == 38);
-			if (i + 1 < codes.size()) {
-				int mode = std::stoi(codes[++i]);
-				if (mode == 5 && i + 1 < codes.size()) {
-					// 256-color mode
-					int index = std::stoi(codes[++i]);
-					TermColor col = colorFrom256(index);
-					if (isForeground)
-						o.procState.currFG = col;
-					else
-						o.procState.currBG = col;
-				} else if (mode == 2 && i + 3 < codes.size()) {
-					// Truecolor mode
-					int r = std::stoi(codes[++i]);
-					int g = std::stoi(codes[++i]);
-					int b = std::stoi(codes[++i]);
-					TermColor col(r, g, b);
-					if (isForeground)
-						o.procState.currFG = col;
-					else
-						o.procState.currBG = col;
-				}
+			TermColor col = TermColor::DefaultForeGround();
+			bool found = false;
+			i = parseExtendedColor(params, i, &col, &found);
+			if (found) {
+				if (code == 38)
+					o.procState.currFG = col;
+				else
+					o.procState.currBG = col;
 			}
 			continue;
 		}
@@ -202,29 +157,15 @@ void applySGRColor(std::string_view codeStr) {
 		}
 		if (idx != -1) {
 			TermColor& target = isForeGround ? o.procState.currFG : o.procState.currBG;
-			if (idx >= 0 && idx < 16) {
-				target = kBasicColors[idx];
-			} else {
-				if (isForeGround) {
-					target = TermColor::DefaultForeGround();
-				} else {
-					target = TermColor::DefaultBackGround();
-				}
-			}
+			target = TermColor::Indexed(idx);
 		} else {
 			std::cout << "INVALID COLOR\n";
 		}
 	}
+	o.procState.pen = o.screen.internStyle(CellStyle{o.procState.currFG, o.procState.currBG, o.procState.currAttr});
 }
 
-void handleGraphicMode(std::string_view data, bool enable) {
-	int mode = 0;
-	try {
-		mode = std::stoi(data);
-	} catch (...) {
-		return; // Invalid mode, ignore
-	}
-
+void handleGraphicMode(int mode, bool enable) {
 	std::cout << "GRAPHIC MODE: " << mode << " " << (enable ? "ENABLE" : "DISABLE") << "\n";
 	switch (mode) {
 	case 0: {
@@ -304,15 +245,8 @@ void handleGraphicMode(std::string_view data, bool enable) {
 	o.needResize = true;
 }
 
-void handleDECPrivateMode(std::string_view data, bool enable) {
+void handleDECPrivateMode(int mode, bool enable) {
 	// Handles DEC Private Mode Set/Reset sequences (e.g., ESC[?7h, ESC[?25l)
-	int mode = 0;
-	try {
-		mode = std::stoi(data);
-	} catch (...) {
-		return; // Invalid mode, ignore
-	}
-
 	switch (mode) {
 	case 1:
 		// Input: Map LF to CRLF
@@ -343,38 +277,27 @@ void handleDECPrivateMode(std::string_view data, bool enable) {
 		// Focus: Track focus events
 		setFlag(TermFlags::TRACK_FOCUS, enable);
 		break;
-	case 1049: {
-		if (enable) {
-			// Save current screen to scrollback
-			o.backupState = o.screen.getScreenState();
-		} else {
-			o.screen.setScreenState(o.backupState);
+	case 1049:
+		// Alternate screen with the cursor saved on the primary one, like DECSC before and DECRC after
+		if (enable && !o.screen.isAlternateScreen()) {
+			saveCursor();
+			o.screen.setAlternateScreen(true);
+		} else if (!enable && o.screen.isAlternateScreen()) {
+			o.screen.setAlternateScreen(false);
+			// The cursor saved on entry, where the primary screen's reflow moved it if it was resized meanwhile
+			o.screen.getPrimaryCursor(o.cursorX, o.cursorY);
 		}
 		break;
-	}
-	case 1047: {
-		if (enable) {
-			// Save current screen to scrollback
-			o.backupState = o.screen.getScreenState();
-			o.backupState.cursorX = 0;
-			o.backupState.cursorY = 0;
-		} else {
-			o.screen.setScreenState(o.backupState);
-		}
+	case 1047:
+		o.screen.setAlternateScreen(enable);
 		break;
-	}
-	case 1048: {
+	case 1048:
 		if (enable) {
-			// Save cursor position
-			o.backupState.cursorX = o.cursorX;
-			o.backupState.cursorY = o.cursorY;
+			saveCursor();
 		} else {
-			// Restore cursor position
-			o.cursorX = o.backupState.cursorX;
-			o.cursorY = o.backupState.cursorY;
+			restoreCursor();
 		}
 		break;
-	}
 	case 2004:
 		// Wrap pasted text in ESC[200~ and ESC[201~ sequences
 		setFlag(TermFlags::BRACKETED_PASTE, enable);
@@ -392,22 +315,16 @@ void handleDECPrivateMode(std::string_view data, bool enable) {
 void handleEraseInDisplay(int mode) {
 	switch (mode) {
 	case 0: { // Erase from cursor to end of screen
-		for (int y = o.cursorY; y < o.rows; ++y) {
-			StyledLine line = o.screen[y];
+		for (int y = o.cursorY; y < o.screen.get_height(); ++y) {
 			int start = (y == o.cursorY) ? o.cursorX : 0;
-			for (size_t x = start; x < line.size(); ++x) {
-				line[x] = makeStyledChar(U' ');
-			}
+			o.screen.eraseCells(y, start, o.screen.get_width());
 		}
 		break;
 	}
 	case 1: { // Erase from start to cursor
 		for (int y = 0; y <= o.cursorY; ++y) {
-			StyledLine line = o.screen[y];
-			int end = (y == o.cursorY) ? o.cursorX : static_cast<int>(line.size());
-			for (int x = 0; x < end && x < static_cast<int>(line.size()); ++x) {
-				line[x] = makeStyledChar(U' ');
-			}
+			int end = (y == o.cursorY) ? o.cursorX : o.screen.get_width();
+			o.screen.eraseCells(y, 0, end);
 		}
 		break;
 	}
@@ -427,214 +344,290 @@ void handleEraseInDisplay(int mode) {
 	}
 }
 
-void handleCSI() {
-	std::string& csiData = o.procState.escBuf;
-	char type = csiData.back();
-	csiData.pop_back();
+void csiSGR(const CsiParams& params) {
+	applySGR(params);
+}
 
-	switch (type) {
-	case 'm': {
-		applySGRColor(csiData);
-		break;
-	}
-	case 'G': {
-		int col = std::stoi(csiData);
-		o.cursorX = col;
-		break;
+void csiCursorColumn(const CsiParams& params) {
+	// the column is 1-based like every other cursor position
+	int col = params.get(0, 1);
+	o.cursorX = std::max(0, col - 1);
+}
+
+void csiCursorUp(const CsiParams& params) {
+	int moveUpBy = params.get(0, 1);
+	if (o.cursorY > moveUpBy) {
+		o.cursorY -= moveUpBy;
+	} else {
+		o.cursorY = 0;
 	}
-	case 'A': {
-		int moveUpBy = std::stoi(csiData, 1);
-		if (o.cursorY > moveUpBy) {
-			o.cursorY -= moveUpBy;
-		} else {
-			o.cursorY = 0;
-		}
-		break;
+}
+
+void csiCursorDown(const CsiParams& params) {
+	int moveDownBy = params.get(0, 1);
+	o.cursorY += moveDownBy;
+}
+
+void csiCursorForward(const CsiParams& params) {
+	int moveForwardBy = params.get(0, 1);
+	o.cursorX += moveForwardBy;
+}
+
+void csiCursorBackward(const CsiParams& params) {
+	int moveBackwardsBy = params.get(0, 1);
+	o.cursorX -= moveBackwardsBy;
+}
+
+void csiTab(const CsiParams& params) {
+	int count = params.get(0, 1);
+	StyledChar blankChar = makeStyledChar(U' ');
+	StyledLine line = o.screen.editRow(o.cursorY);
+	for (int i = o.cursorX; i < line.size() && count > 0; ++i, --count) {
+		line[i] = blankChar;
 	}
-	case 'B': {
-		int moveDownBy = std::stoi(csiData, 1);
-		o.cursorY += moveDownBy;
-		break;
+}
+
+void csiDECPrivateModeSet(const CsiParams& params) {
+	for (int i = 0; i < params.count; ++i) {
+		handleDECPrivateMode(params.get(i, 0), true);
 	}
-	case 'C': {
-		int moveForwardBy = std::stoi(csiData, 1);
-		o.cursorX += moveForwardBy;
-		break;
+}
+
+void csiDECPrivateModeReset(const CsiParams& params) {
+	for (int i = 0; i < params.count; ++i) {
+		handleDECPrivateMode(params.get(i, 0), false);
 	}
-	case 'D': {
-		int moveBackwardsBy = std::stoi(csiData, 1);
-		o.cursorX -= moveBackwardsBy;
-		break;
+}
+
+// handles changing the graphic mode
+void csiGraphicModeSet(const CsiParams& params) {
+	for (int i = 0; i < params.count; ++i) {
+		handleGraphicMode(params.get(i, 0), true);
 	}
-	case 'I': {
-		int count = std::stoi(csiData, 1);
-		StyledChar blankChar = makeStyledChar(U' ');
-		StyledLine line = o.screen[o.cursorY];
-		for (int i = o.cursorX; i < line.size() && count > 0; ++i, --count) {
-			line[i] = blankChar;
-		}
-		break;
+}
+
+void csiGraphicModeReset(const CsiParams& params) {
+	for (int i = 0; i < params.count; ++i) {
+		handleGraphicMode(params.get(i, 0), false);
 	}
-	case 'l':
-	case 'h': {
-		if (csiData.empty()) {
-			break;
-		}
-		std::string_view data = std::string_view(csiData.data() + 1, csiData.size() - 1);
-		if (csiData[0] == '?') {
-			handleDECPrivateMode(data, type == 'h');
-		} else if (csiData[0] == '=') {
-			// handles changing the graphic mode
-			handleGraphicMode(data, type == 'h');
-		}
-		break;
+}
+
+void csiCursorPosition(const CsiParams& params) {
+	int row = params.get(0, 1);
+	int col = params.get(1, 1);
+	o.cursorY = std::max(0, row - 1);
+	o.cursorX = std::max(0, col - 1);
+}
+
+void csiEraseInLine(const CsiParams& params) {
+	int mode = params.get(0, 0);
+	if (mode == 0) {
+		o.screen.eraseCells(o.cursorY, o.cursorX, o.screen.get_width());
 	}
-	case 'H': {
-		if (csiData.empty()) {
-			o.cursorX = 0;
-			o.cursorY = 0;
-			break;
-		}
-		auto params = split(csiData, ';');
-		try {
-			int row = (params.size() > 0 && !params[0].empty()) ? std::stoi(params[0]) : 1;
-			int col = (params.size() > 1 && !params[1].empty()) ? std::stoi(params[1]) : 1;
-			o.cursorY = std::max(0, row - 1);
-			o.cursorX = std::max(0, col - 1);
-		} catch (...) {
-		}
-		break;
+}
+
+void csiEraseInDisplay(const CsiParams& params) {
+	handleEraseInDisplay(params.get(0, 0));
+}
+
+void csiDeleteChars(const CsiParams& params) {
+	int numOfChars = params.get(0, 1);
+	StyledLine line = o.screen.editRow(o.cursorY);
+	int lineLen = static_cast<int>(line.size());
+	int start = o.cursorX;
+
+	// Shift characters left
+	for (int i = start; i + numOfChars < lineLen; ++i) {
+		line[i] = line[i + numOfChars];
 	}
-	case 'K': {
-		int mode = 0;
-		try {
-			if (csiData.empty())
-				mode = 0;
-			else {
-				mode = std::stoi(csiData);
-			}
-		} catch (...) {
-		}
-		if (mode == 0) {
-			StyledLine line = o.screen[o.cursorY];
-			if (!line.empty()) {
-				for (size_t i = o.cursorX; i < line.size(); ++i) {
-					line[i] = makeStyledChar(U' ');
-				}
-			}
-		}
-		break;
+	// Fill the emptied cells with spaces
+	StyledChar blankChar = makeStyledChar(U' ');
+	for (int i = std::max(start, lineLen - numOfChars); i < lineLen; ++i) {
+		line[i] = blankChar;
 	}
-	case 'J': {
-		int mode = 0;
-		if (!csiData.empty()) {
-			try {
-				mode = std::stoi(csiData);
-			} catch (...) {
-			}
-		}
-		handleEraseInDisplay(mode);
-		break;
+}
+
+void csiWindowOps(const CsiParams& params) {
+	if (params.get(0, 0) == 22) {
+		// restore window size
+		// does nothing for now
 	}
-	case 'P': {
-		int numOfChars = std::stoi(csiData, 1); // Default to 1 if empty
-		StyledLine line = o.screen[o.cursorY];
-		int lineLen = static_cast<int>(line.size());
-		int start = o.cursorX;
-		int end = std::min(start + numOfChars, lineLen);
+}
 
-		// Shift characters left
-		for (int i = start; i + numOfChars < lineLen; ++i) {
-			line[i] = line[i + numOfChars];
-		}
-		// Fill the emptied cells with spaces
-		StyledChar blankChar = makeStyledChar(U' ');
-		for (int i = lineLen - numOfChars; i < lineLen; ++i) {
-			if (i >= start) {
-				line[i] = blankChar;
-			}
-		}
-		break;
+// DECSTBM, limits scrolling to a range of rows
+// example: ESC [ 1 ; 24 r, will limit from row 1 to 24. (the first row is 1)
+void csiScrollRegion(const CsiParams& params) {
+	// An explicit 0 stands for the default too
+	int top = std::max(params.get(0, 1), 1);
+	int bottom = params.get(1, 0);
+	if (bottom == 0) {
+		bottom = o.screen.get_height();
 	}
-	case 't': {
-		auto params = split(csiData, ';');
-		if (params[0] == "22") {
-			// restore window size
-			// does nothing for now
-		}
-		break;
+	if (top >= bottom || bottom > o.screen.get_height()) {
+		return;
 	}
-	case 'r': {
-		// Limit scroll region
-		// example: ESC [ 1 ; 24 r, will limit from row 1 to 24. (the first row is 1)
-		// unimplemented
-		std::cout << "CSI r: " << csiData << "\n";
-		break;
+	o.screen.setScrollRegion(top - 1, bottom - 1);
+	o.cursorX = 0;
+	o.cursorY = 0;
+}
+
+void csiLinePosition(const CsiParams& params) {
+	// Move cursor to row
+	int row = params.get(0, 1);
+	o.cursorY = std::max(0, row - 1);
+	o.cursorX = 0; // Reset column to 0
+}
+
+void csiEraseChars(const CsiParams& params) {
+	int numOfSpace = params.get(0, 1);
+	o.screen.eraseCells(o.cursorY, o.cursorX, o.cursorX + numOfSpace);
+}
+
+void csiScrollUp(const CsiParams& params) {
+	o.screen.scrollUp(params.get(0, 1));
+}
+
+void csiScrollDown(const CsiParams& params) {
+	o.screen.scrollDown(params.get(0, 1));
+}
+
+void csiInsertLines(const CsiParams& params) {
+	o.screen.insertLines(o.cursorY, params.get(0, 1));
+	o.cursorX = 0;
+}
+
+void csiDeleteLines(const CsiParams& params) {
+	o.screen.deleteLines(o.cursorY, params.get(0, 1));
+	o.cursorX = 0;
+}
+
+// DECSTR
+void csiSoftReset(const CsiParams&) {
+	o.flags |= TermFlags::OUTPUT_WRAP_LINES;
+	o.flags |= TermFlags::OUTPUT_ESCAPE_CODES;
+	o.needResize = true;
+}
+
+// A CSI sequence is identified by its private marker, its intermediate and its final byte, so a handler is
+// found with one lookup in a table indexed by all three.
+using CsiHandler = void (*)(const CsiParams&);
+
+constexpr int CsiMarkerSlots = 5;		 // none, < = > ?
+constexpr int CsiIntermediateSlots = 17; // none, 0x20..0x2F
+constexpr int CsiFinalSlots = 0x7E - 0x40 + 1;
+
+constexpr int csiSlot(char privateMarker, char intermediate, char final) {
+	int marker = privateMarker ? privateMarker - 0x3B : 0;
+	int inter = intermediate ? intermediate - 0x1F : 0;
+	return (marker * CsiIntermediateSlots + inter) * CsiFinalSlots + (final - 0x40);
+}
+
+struct CsiDispatchTable {
+	CsiHandler handlers[CsiMarkerSlots * CsiIntermediateSlots * CsiFinalSlots];
+
+	constexpr void add(char privateMarker, char intermediate, char final, CsiHandler handler) {
+		handlers[csiSlot(privateMarker, intermediate, final)] = handler;
 	}
-	case 'd': {
-		// Move cursor to row
-		int row = row = std::stoi(csiData, 1);
-		o.cursorY = std::max(0, row - 1);
-		o.cursorX = 0; // Reset column to 0
-		break;
+};
+
+constexpr CsiDispatchTable buildCsiDispatchTable() {
+	CsiDispatchTable t{};
+	t.add(0, 0, 'A', csiCursorUp);
+	t.add(0, 0, 'B', csiCursorDown);
+	t.add(0, 0, 'C', csiCursorForward);
+	t.add(0, 0, 'D', csiCursorBackward);
+	t.add(0, 0, 'G', csiCursorColumn);
+	t.add(0, 0, 'H', csiCursorPosition);
+	t.add(0, 0, 'I', csiTab);
+	t.add(0, 0, 'J', csiEraseInDisplay);
+	t.add(0, 0, 'K', csiEraseInLine);
+	t.add(0, 0, 'L', csiInsertLines);
+	t.add(0, 0, 'M', csiDeleteLines);
+	t.add(0, 0, 'P', csiDeleteChars);
+	t.add(0, 0, 'S', csiScrollUp);
+	t.add(0, 0, 'T', csiScrollDown);
+	t.add(0, 0, 'X', csiEraseChars);
+	t.add(0, 0, 'd', csiLinePosition);
+	t.add(0, 0, 'm', csiSGR);
+	t.add(0, 0, 'r', csiScrollRegion);
+	t.add(0, 0, 't', csiWindowOps);
+	t.add('?', 0, 'h', csiDECPrivateModeSet);
+	t.add('?', 0, 'l', csiDECPrivateModeReset);
+	t.add('=', 0, 'h', csiGraphicModeSet);
+	t.add('=', 0, 'l', csiGraphicModeReset);
+	t.add(0, '!', 'p', csiSoftReset);
+	return t;
+}
+
+constexpr CsiDispatchTable csiDispatchTable = buildCsiDispatchTable();
+
+void handleCSI(char final) {
+	const CsiParams& params = o.procState.csi;
+	// only one intermediate is part of the key, sequences with more are not something we support
+	CsiHandler handler = nullptr;
+	if (params.intermediateCount <= 1) {
+		handler = csiDispatchTable.handlers[csiSlot(params.privateMarker, params.intermediate, final)];
 	}
-	case 'X': {
-		int numOfSpace = std::stoi(csiData);
-		StyledLine line = o.screen[o.cursorY];
-		for (int i = 0; i < numOfSpace && o.cursorX + i < line.size(); ++i) {
-			line[o.cursorX + i] = makeStyledChar(U' ');
-		}
-		break;
+	if (handler) {
+		handler(params);
+	} else {
+		o.procState.unknownSequences++;
 	}
-	case 'S': {
-		// Scroll up
-		int lines = std::stoi(csiData, 1);
-		o.screen.data();
-		for (int y = 0; y < o.rows - lines; ++y) {
-			o.screen[y] = o.screen[y + lines];
-		}
-		for (int y = o.rows - lines; y < o.rows; ++y) {
-			for (int x = 0; x < o.cols; ++x) {
-				o.screen[y][x] = makeStyledChar(U' ');
-			}
+}
+
+// Pops the text up to the next ';' off `rest`
+std::string_view nextOSCField(std::string_view& rest) {
+	size_t pos = rest.find(';');
+	std::string_view field = rest.substr(0, pos);
+	rest = pos == std::string_view::npos ? std::string_view() : rest.substr(pos + 1);
+	return field;
+}
+
+bool parseOSCNumber(std::string_view text, int* out) {
+	auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), *out);
+	return !text.empty() && ec == std::errc() && end == text.data() + text.size();
+}
+
+// OSC 4 ; index ; spec [; index ; spec ...], queries ("?") are not answered
+void setPaletteColors(std::string_view content) {
+	while (!content.empty()) {
+		int index = 0;
+		bool validIndex = parseOSCNumber(nextOSCField(content), &index);
+		std::string_view spec = nextOSCField(content);
+		TermColor color;
+		if (validIndex && index >= 0 && index < Palette::Size && parseColorSpec(spec, &color)) {
+			o.palette.colors[index] = color;
 		}
-		break;
 	}
-	case 'p': {
-		if (csiData.empty() || csiData[0] != '!') {
-			break;
-		}
-		o.flags |= TermFlags::OUTPUT_WRAP_LINES;
-		o.flags |= TermFlags::OUTPUT_ESCAPE_CODES;
-		o.needResize = true;
-		break;
+}
 
+// OSC 104 [; index ...], without indices the whole palette is reset
+void resetPaletteColors(std::string_view content) {
+	if (content.empty()) {
+		for (int i = 0; i < Palette::Size; ++i) {
+			o.palette.resetColor(i);
+		}
+		return;
 	}
-	default: {
-		std::cout << "[" << type << "]'" << csiData << "'\n";
-		break;
-	}
+	while (!content.empty()) {
+		int index = 0;
+		if (parseOSCNumber(nextOSCField(content), &index)) {
+			o.palette.resetColor(index);
+		}
 	}
-
-	csiData.clear();
 }
 
 void handleOSC() {
 	std::string& oscData = o.procState.escBuf;
-	size_t semicolonPos = oscData.find(';');
-	if (semicolonPos == std::string_view::npos) {
-		// No parameter found — treat whole as default OSC command (e.g., title)
-		platform::setWindowTitle(oscData.c_str());
-		return;
-	}
-
-	std::string_view param = std::string_view(oscData.data(), semicolonPos);
-	std::string_view content = std::string_view(oscData.data() + semicolonPos + 1, oscData.size() - semicolonPos - 1);
+	std::string_view content = oscData;
+	std::string_view param = nextOSCField(content);
 
 	int paramNum = 0;
-	try {
-		paramNum = std::stoi(param);
-	} catch (...) {
+	if (!parseOSCNumber(param, &paramNum)) {
+		if (content.data() == nullptr) {
+			// No parameter found — treat whole as default OSC command (e.g., title)
+			getTerminalHost().setWindowTitle(oscData.c_str());
+		}
 		return;
 	}
 
@@ -642,7 +635,7 @@ void handleOSC() {
 	case 0:
 	case 2:
 		// Set both icon name and window title (0) or window title only (2)
-		platform::setWindowTitle(content.data());
+		getTerminalHost().setWindowTitle(content.data() ? content.data() : "");
 		break;
 
 	case 1:
@@ -650,174 +643,251 @@ void handleOSC() {
 		// setIconName(std::string(content));
 		break;
 
+	case 4:
+		setPaletteColors(content);
+		break;
+
+	case 10:
+		parseColorSpec(content, &o.palette.foreground);
+		break;
+
+	case 11:
+		parseColorSpec(content, &o.palette.background);
+		break;
+
 	case 52:
 		// Clipboard operations (OSC 52) could be handled here
 		// handleClipboard(content);
 		break;
 
+	case 104:
+		resetPaletteColors(content);
+		break;
+
+	case 110:
+		o.palette.foreground = Palette::DefaultForeground;
+		break;
+
+	case 111:
+		o.palette.background = Palette::DefaultBackground;
+		break;
+
 	default:
 		// Unknown/unhandled OSC command — ignore or log
 		break;
 	}
+	if (paramNum == 4 || paramNum == 10 || paramNum == 11 || paramNum == 104 || paramNum == 110 || paramNum == 111) {
+		o.screen.markAllDirty(); // the palette changed, cells using it look different
+	}
 	oscData.clear();
 }
 }
 
-void processPartialOutputSegment(const std::vector<char>& inputSegment) {
-	o.procState.leftover.append(inputSegment.data(), inputSegment.size());
-	size_t i = 0;
-
-	char utf8Accum[4]{};
-	size_t utf8AccumLen = 0;
-
-	while (i < o.procState.leftover.size()) {
-		char c = o.procState.leftover[i];
-
-		switch (o.procState.state) {
-		case ProcState::None:
-			switch (c) {
-			case '\033': { // ESC
-				o.procState.state = ProcState::SawESC;
-				i++;
-				break;
-			}
-			case '\r': {
-				o.cursorX = 0;
-				i++;
-				break;
-			}
-			case '\f': // Form Feed
-				o.screen.clear();
+namespace
+{
+void wrapCursorIfNeeded() {
+	if (o.flags.has(TermFlags::OUTPUT_WRAP_LINES)) {
+		if (o.cursorX >= o.rows) {
+#ifdef _WIN32
+			if (o.cursorY < o.cols - 2) {
+#endif
 				o.cursorX = 0;
-				o.cursorY = 0;
-				i++;
-				break;
-
-			case '\t': // Tab
-				for (int t = 0; t < 4; ++t) {
-					o.screen.atCursor() = makeStyledChar(U' ');
-					o.cursorX++;
-				}
-				i++;
-				break;
-
-			case '\b': {
-				// Backspace
-				if (o.cursorX > 0) {
-					o.cursorX--;
-				}
-				i++;
-				break;
+				o.screen.setWrapped(o.cursorY);
+				o.screen.newLine(); // Move to next line if we wrap
+#ifdef _WIN32
 			}
-			case '\n': {
-				// Commit the current line and reset
-				o.screen.newLine();
-
-#ifdef __linux__
-				o.cursorX = 0;
 #endif
-				i++;
-				break;
-			}
-			default: {
-				if (utf8AccumLen < 4) {
-					utf8Accum[utf8AccumLen++] = c;
-				}
-				// Try to decode as much as possible
-				const char* utf8Buf = utf8Accum;
-				const char* utf8End = utf8Accum + utf8AccumLen;
-				while (utf8Buf < utf8End) {
-					char32_t cp;
-					int len = decode_utf8(utf8Buf, &cp);
-					if (len <= 0 || utf8Buf + len > utf8End)
-						break;
-					utf8Buf += len;
-
-					o.screen.atCursor() = makeStyledChar(cp);
-					o.cursorX++;
-				}
-				// Remove processed bytes from utf8Accum
-				size_t processed = utf8Buf - utf8Accum;
-				if (processed > 0) {
-					memmove(utf8Accum, utf8Accum + processed, utf8AccumLen - processed);
-					utf8AccumLen -= processed;
-				}
-				i++;
-				break;
-			}
-			}
-			break;
+		}
+	} else if (o.cursorX >= o.rows) {
+		// aaaaao.cursorX = o.rows - 1;
+	}
+}
 
-		case ProcState::SawESC:
-			if (c == '[') {
-				o.procState.state = ProcState::SawCSIBracket;
-			} else if (c == ']') {
-				o.procState.state = ProcState::SawOSCBracket;
-			} else {
-				o.procState.state = ProcState::None;
-			}
-			i++;
-			break;
-
-		case ProcState::SawCSIBracket: {
-			o.procState.escBuf += c;
-			if ((unsigned char)c >= 0x40 && (unsigned char)c <= 0x7E) {
-				o.procState.state = ProcState::None;
-				handleCSI();
-			}
-			i++;
-			break;
+// Writes characters at the cursor a row at a time, wrapping exactly like writing them one by one would
+template <typename Char>
+void writeTextRun(const Char* text, size_t len) {
+	int width = o.screen.get_width();
+	bool wrap = o.flags.has(TermFlags::OUTPUT_WRAP_LINES);
+	while (len > 0) {
+		if (o.cursorX >= width) {
+			o.cursorX = width - 1;
+		}
+		if (!wrap && o.cursorX == width - 1) {
+			// Everything past the edge lands on the last cell, only the final character survives
+			o.screen.writeRun(text + len - 1, 1);
+			o.cursorX = width;
+			return;
+		}
+		size_t chunk = std::min<size_t>(len, width - o.cursorX);
+		if (wrap) {
+			chunk = std::min<size_t>(chunk, std::max(1, o.rows - o.cursorX));
+		}
+		o.screen.writeRun(text, static_cast<int>(chunk));
+		o.cursorX += static_cast<int>(chunk);
+		text += chunk;
+		len -= chunk;
+		wrapCursorIfNeeded();
+	}
+}
+
+void writeUtf8Run(const char* text, size_t len) {
+	char32_t decoded[512];
+	while (len > 0) {
+		size_t consumed = 0;
+		size_t count = decode_utf8_stream(o.procState.utf8, text, len, decoded, std::size(decoded), &consumed);
+		writeTextRun(decoded, count);
+		text += consumed;
+		len -= consumed;
+	}
+}
+
+// C0 controls that do something, the rest are ignored
+void executeControl(char c) {
+	switch (c) {
+	case '\r':
+		o.cursorX = 0;
+		break;
+	case '\f': // Form Feed
+		o.screen.clear();
+		o.cursorX = 0;
+		o.cursorY = 0;
+		break;
+	case '\t': // Tab
+		for (int t = 0; t < 4; ++t) {
+			o.screen.atCursor() = makeStyledChar(U' ');
+			o.cursorX++;
 		}
-		case ProcState::SawOSCBracket: {
-			if (c == '\033') {
-				o.procState.state = ProcState::SawOSCBracketAndESC; // saw ESC inside OSC
-			} else if (c == 0x07) {
-				// BEL terminator found — end of OSC
-				o.procState.state = ProcState::None;
-				handleOSC();
-				o.procState.escBuf.clear();
-			} else {
-				o.procState.escBuf += c;
-			}
-			i++;
-			break;
+		break;
+	case '\b': // Backspace
+		if (o.cursorX > 0) {
+			o.cursorX--;
 		}
+		break;
+	case '\n':
+		// Commit the current line and reset
+		o.screen.newLine();
+#ifdef __linux__
+		o.cursorX = 0;
+#endif
+		break;
+	default:
+		break;
+	}
+}
 
-		case ProcState::SawOSCBracketAndESC: {
-			if (c == '\\') {
-				// ESC \ terminator found — end of OSC
-				o.procState.state = ProcState::None;
-				handleOSC();
-				o.procState.escBuf.clear();
+// ESC followed by a final byte, the intermediates were collected into csi
+void handleEscape(char final) {
+	if (o.procState.csi.intermediateCount != 0) {
+		return; // character set designations and the like, nothing we support
+	}
+	switch (final) {
+	case '7': // DECSC
+		saveCursor();
+		break;
+	case '8': // DECRC
+		restoreCursor();
+		break;
+	case 'D': // IND
+		o.screen.newLine();
+		break;
+	case 'E': // NEL
+		o.screen.newLine();
+		o.cursorX = 0;
+		break;
+	case 'M': // RI
+		o.screen.reverseNewLine();
+		break;
+	default:
+		break;
+	}
+}
+
+void runAction(VtAction action, char c) {
+	switch (action) {
+	case VtAction::None:
+	case VtAction::Ignore:
+	case VtAction::Print: // printing is done in runs by processPartialOutputSegment
+		break;
+	case VtAction::Execute:
+		executeControl(c);
+		break;
+	case VtAction::Clear:
+		o.procState.csi.clear();
+		break;
+	case VtAction::Collect:
+		o.procState.csi.collect(c);
+		break;
+	case VtAction::Param:
+		o.procState.csi.param(c);
+		break;
+	case VtAction::OscStart:
+		o.procState.escBuf.clear();
+		break;
+	case VtAction::OscPut:
+		o.procState.escBuf += c;
+		break;
+	case VtAction::EscDispatch:
+		handleEscape(c);
+		break;
+	case VtAction::CsiDispatch:
+		handleCSI(c);
+		break;
+	case VtAction::OscEnd:
+		handleOSC();
+		o.procState.escBuf.clear();
+		break;
+	case VtAction::Hook:
+	case VtAction::Put:
+	case VtAction::Unhook:
+		// DCS payloads (sixel, DECRQSS, ...) are not supported
+		break;
+	default:
+		break;
+	}
+}
+}
+
+void processPartialOutputSegment(const std::vector<char>& inputSegment) {
+	const char* data = inputSegment.data();
+	size_t size = inputSegment.size();
+	size_t i = 0;
+
+	while (i < size) {
+		char c = data[i];
+		VtState state = o.procState.state;
+		VtAction action = vtTables.action(state, static_cast<uint8_t>(c));
+
+		if (action == VtAction::Print) {
+			// Plain text is most of what we get, so take whole runs at once
+			if (!o.procState.utf8.pending() && c >= 0x20 && c < 0x7F) {
+				size_t run = findNonPrintableAscii(data + i, size - i);
+				writeTextRun(data + i, run);
+				i += run;
 			} else {
-				// False alarm, ESC wasn't terminator - push ESC + current char to buffer
-				o.procState.escBuf += '\033';
-				o.procState.escBuf += c;
-				o.procState.state = ProcState::SawOSCBracket;
+				// UTF-8 text, a sequence left incomplete at the end is finished by the next segment
+				size_t run = findControlByte(data + i, size - i);
+				writeUtf8Run(data + i, run);
+				i += run;
 			}
-			i++;
-			break;
-		}
+			continue;
 		}
 
-		if (o.flags.has(TermFlags::OUTPUT_WRAP_LINES)) {
-			if (o.cursorX >= o.rows) {
-#ifdef _WIN32
-				if (o.cursorY < o.cols - 2) {
-#endif
-					o.cursorX = 0;
-					o.screen.newLine(); // Move to next line if we wrap
-#ifdef _WIN32
-				}
-#endif
+		if (state == VtState::Ground && reset_utf8_stream(o.procState.utf8)) {
+			// A control character cut a multibyte sequence short
+			writeTextRun(&ReplacementCharacter, 1);
+		}
 
-			}
-		} else if (o.cursorX >= o.rows) {
-			// aaaaao.cursorX = o.rows - 1;
+		VtState next = vtTables.next(state, static_cast<uint8_t>(c));
+		if (next != state) {
+			runAction(vtTables.onExit[static_cast<int>(state)], c);
 		}
-	}
+		runAction(action, c);
+		if (next != state) {
+			o.procState.state = next;
+			runAction(vtTables.onEntry[static_cast<int>(next)], c);
+		}
+		i++;
 
-	if (i > 0) {
-		o.procState.leftover.erase(o.procState.leftover.begin(), o.procState.leftover.begin() + i);
+		wrapCursorIfNeeded();
 	}
-}
\ No newline at end of file
+}
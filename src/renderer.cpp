@@ -3,16 +3,20 @@
 #include <stb_truetype.h>
 #include <platform/tools.h>
 #include "utf8.h"
+#include <algorithm>
+#include <climits>
 #include <cmath>
+#include <memory>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <string>
 #include <cstring>
 #include <cstdio>
+#include <iostream>
 #include "styledScreen.h"
 
-static void uploadAtlasTexture();
+static constexpr uint16_t NoSlot = UINT16_MAX;
 
 struct Glyph {
 	float ax; // advance.x
@@ -22,18 +26,23 @@ struct Glyph {
 	float bl; // bitmap left
 	float bt; // bitmap top
 	float tx; // x offset in atlas
+	float ty; // y offset in atlas
+	uint32_t lastUsed; // frame the glyph was last put into a row
+	uint16_t slot = NoSlot; // index in the glyph table, NoSlot while the glyph is not loaded
+	uint8_t page; // atlas layer
+	bool pinned; // never evicted
 };
 
 static const char* fragmentShaderSrc = R"glsl(
 #version 330 core
-in vec2 frag_uv;
+in vec3 frag_uv;
 in vec4 frag_color;
 out vec4 out_color;
 
-uniform sampler2D tex;
+uniform sampler2DArray tex;
 
 void main() {    
-	if (frag_uv == vec2(0.0, 0.0)) {
+	if (frag_uv.xy == vec2(0.0, 0.0)) {
         out_color = frag_color;
     } else {
 		float alpha = texture(tex, frag_uv).r;
@@ -50,21 +59,71 @@ layout(location = 0) in vec2 in_pos;
 layout(location = 1) in vec2 in_uv;
 layout(location = 2) in vec4 in_color;
 
-out vec2 frag_uv;
+out vec3 frag_uv;
 out vec4 frag_color;
 
 uniform vec2 screenSize;
+uniform float layer;
 
 void main() {
     vec2 pos = in_pos / screenSize * 2.0 - 1.0;
     pos.y = -pos.y;
     gl_Position = vec4(pos, 0.0, 1.0);
-    frag_uv = in_uv;
+    frag_uv = vec3(in_uv, layer);
     frag_color = in_color;
 }
 
 )glsl";
 
+// Cell data is pulled from buffer textures instead of vertex attributes: vertex v draws the quad of record
+// v / 6. In the background pass a record is a run of cells with the same background, in the glyph pass a glyph.
+// Row regions start every `cols` records and are a ring, region r is drawn at row (r - rowBase) mod regionCount
+static const char* cellVertexShaderSrc = R"glsl(
+#version 330 core
+
+out vec3 frag_uv;
+out vec4 frag_color;
+
+uniform bool backgroundPass;
+// Two RG32UI texels per record: column and glyph slot or run length, color
+uniform usamplerBuffer records;
+// Three texels per glyph: left, top, width, height of its box, u0, v0, u1, v1 in the atlas and its layer
+uniform samplerBuffer glyphTable;
+uniform vec2 screenSize;
+uniform vec2 cellSize;
+uniform float ascent;
+uniform int cols;
+uniform float rowBase;
+uniform float regionCount;
+
+const vec2 corners[6] = vec2[6](vec2(0, 0), vec2(1, 0), vec2(0, 1), vec2(1, 0), vec2(1, 1), vec2(0, 1));
+
+void main() {
+    int index = gl_VertexID / 6;
+    uvec2 record = texelFetch(records, index).xy;
+    float row = mod(float(index / cols) - rowBase, regionCount);
+    vec2 cell = vec2(float(record.x & 0xFFFFu), row) * cellSize;
+    vec2 corner = corners[gl_VertexID % 6];
+    frag_color = vec4(uvec4(record.y, record.y >> 8, record.y >> 16, 255u) & 0xFFu) / 255.0;
+    vec2 pos;
+    if (backgroundPass) {
+        pos = cell + corner * cellSize * vec2(float(record.x >> 16), 1.0);
+        frag_uv = vec3(0.0, 0.0, 0.0);
+    } else {
+        int glyph = int(record.x >> 16);
+        vec4 box = texelFetch(glyphTable, glyph * 3);
+        vec4 uv = texelFetch(glyphTable, glyph * 3 + 1);
+        float layer = texelFetch(glyphTable, glyph * 3 + 2).x;
+        pos = floor(cell + vec2(box.x, ascent + box.y) + 0.5) + corner * box.zw;
+        frag_uv = vec3(mix(uv.xy, uv.zw, corner), layer);
+    }
+    pos = pos / screenSize * 2.0 - 1.0;
+    pos.y = -pos.y;
+    gl_Position = vec4(pos, 0.0, 1.0);
+}
+
+)glsl";
+
 
 static constexpr int ATLAS_WIDTH = 2048;
 static constexpr int ATLAS_HEIGHT = ATLAS_WIDTH;
@@ -73,14 +132,42 @@ static constexpr int CURSOR_CODEPOINT = 0x2588;
 static stbtt_fontinfo fontInfo;
 static unsigned char* ttfBuffer = nullptr;
 
-static unsigned char atlasBitmap[ATLAS_WIDTH * ATLAS_HEIGHT];
 static GLuint atlasTexture = 0;
 static float scale = 0.0f;
-static int atlasX = 0;
-static int atlasY = 0;
-static int atlasRowHeight = 0;
 
-static std::unordered_map<char32_t, Glyph> glyphs;
+// The atlas is a texture array of pages filled as glyphs are first drawn. When they are all full, the least
+// recently used glyphs are evicted and their page is packed again
+static constexpr int ATLAS_PAGES = 4;
+
+// A horizontal segment of the skyline, the top edge of what is packed below it
+struct SkylineNode {
+	int x;
+	int y;
+	int width;
+};
+
+struct AtlasPage {
+	std::vector<unsigned char> bitmap;	// empty until the page is first used
+	std::vector<SkylineNode> skyline;	// left to right, covers the whole width
+	size_t usedArea = 0;				// pixels taken by glyphs, padding included
+	// Part of the bitmap that changed since the last upload, empty when dirtyX0 >= dirtyX1
+	int dirtyX0 = ATLAS_WIDTH;
+	int dirtyY0 = ATLAS_HEIGHT;
+	int dirtyX1 = 0;
+	int dirtyY1 = 0;
+};
+
+static AtlasPage atlasPages[ATLAS_PAGES];
+static int atlasPageCount = 0;
+static uint32_t atlasFrame = 0;
+// Set when a repack could not fit a glyph the cached rows still use back in, they have to be rebuilt
+static bool atlasLostRowGlyph = false;
+
+// Glyphs by codepoint. The BMP is indexed directly, in pages of 256 codepoints allocated when one of them is
+// first drawn, only the other planes go through a hash map
+static constexpr int GLYPH_PAGE_SIZE = 256;
+static std::unique_ptr<Glyph[]> bmpGlyphs[0x10000 / GLYPH_PAGE_SIZE];
+static std::unordered_map<char32_t, Glyph> astralGlyphs;
 
 static int ascent = 0;
 static int descent = 0;
@@ -94,6 +181,52 @@ struct Vertex {
 	float r, g, b, a;
 };
 
+// What the cell shader reads, see cellVertexShaderSrc. Blank cells have no glyph record and cells with the
+// default background are not in any run
+struct GlyphRecord {
+	uint16_t col;
+	uint16_t glyph; // slot in the glyph table
+	uint32_t color; // RGB8
+};
+
+struct BackgroundRun {
+	uint16_t col;
+	uint16_t length;
+	uint32_t color; // RGB8
+};
+
+static_assert(sizeof(GlyphRecord) == 8 && sizeof(BackgroundRun) == 8, "records are read as RG32UI texels");
+
+// Records of the screen rows stay in their buffers between frames, each row in a region of cols records, and
+// only the rows the screen reports dirty are rebuilt. The regions are used as a ring so that when the whole
+// screen scrolls, only rowBase moves and the rows that came in are rebuilt
+struct RecordBuffer {
+	GLuint buffer = 0;
+	GLuint texture = 0;
+	std::vector<GLint> first; // first vertex of each region
+	std::vector<GLsizei> vertexCount;
+};
+
+static GLuint cellVao = 0, cellProgram = 0;
+static RecordBuffer glyphRecords, backgroundRuns;
+static int regionRows = 0;
+static int regionCols = 0;
+static int rowBase = 0;
+static bool wasScrolledBack = false;
+static std::vector<GlyphRecord> rowGlyphs;
+static std::vector<BackgroundRun> rowRuns;
+
+// Glyph boxes and atlas coordinates by slot, read by the cell shader through a buffer texture
+static std::vector<float> glyphTable;
+static constexpr char32_t NoCodepoint = UINT32_MAX;
+static std::vector<char32_t> slotOwners; // codepoint of the glyph in each slot, NoCodepoint when free
+static std::vector<uint16_t> freeSlots;
+// Glyph records of the cached row regions by slot, glyphs still in a row are never evicted
+static std::vector<uint32_t> slotRefs;
+static std::vector<std::vector<uint16_t>> regionSlots; // slots of the glyph records of each region
+static GLuint glyphTableBuffer = 0, glyphTableTexture = 0;
+static bool glyphTableChanged = false;
+
 struct vec4 {
 	union {
 		struct {
@@ -110,6 +243,10 @@ static constexpr vec4 termColorToRGBA(TermColor color) {
 	return {color.r / 255.0f, color.g / 255.0f, color.b / 255.0f, 1.0f};
 }
 
+static constexpr uint32_t packRGB(TermColor color) {
+	return uint32_t(color.r) | uint32_t(color.g) << 8 | uint32_t(color.b) << 16;
+}
+
 static GLuint compileShader(GLenum type, const char* src) {
 	GLuint shader = glCreateShader(type);
 	glShaderSource(shader, 1, &src, nullptr);
@@ -117,8 +254,8 @@ static GLuint compileShader(GLenum type, const char* src) {
 	return shader;
 }
 
-static GLuint createShaderProgram() {
-	GLuint vs = compileShader(GL_VERTEX_SHADER, vertexShaderSrc);
+static GLuint createShaderProgram(const char* vertexSrc) {
+	GLuint vs = compileShader(GL_VERTEX_SHADER, vertexSrc);
 	GLuint fs = compileShader(GL_FRAGMENT_SHADER, fragmentShaderSrc);
 	GLuint program = glCreateProgram();
 	glAttachShader(program, vs);
@@ -129,134 +266,367 @@ static GLuint createShaderProgram() {
 	return program;
 }
 
-static bool tryPackGlyph(char32_t cp) {
-	if (glyphs.find(cp) != glyphs.end())
-		return true;
-
-	int glyphIndex = stbtt_FindGlyphIndex(&fontInfo, cp);
-	if (glyphIndex == 0)
-		return false;
+// Where the glyph of cp is kept, its slot is NoSlot if it is not loaded
+static Glyph& glyphEntry(char32_t cp) {
+	if (cp >= 0x10000) {
+		return astralGlyphs[cp];
+	}
+	std::unique_ptr<Glyph[]>& page = bmpGlyphs[cp / GLYPH_PAGE_SIZE];
+	if (!page) {
+		page.reset(new Glyph[GLYPH_PAGE_SIZE]);
+	}
+	return page[cp % GLYPH_PAGE_SIZE];
+}
 
-	int advance, lsb;
-	stbtt_GetGlyphHMetrics(&fontInfo, glyphIndex, &advance, &lsb);
+static void forgetGlyph(char32_t cp) {
+	if (cp >= 0x10000) {
+		astralGlyphs.erase(cp);
+	} else {
+		glyphEntry(cp).slot = NoSlot;
+	}
+}
 
-	int glyphW, glyphH, xoff, yoff;
-	unsigned char* bitmap = stbtt_GetGlyphBitmap(&fontInfo, scale, scale, glyphIndex, &glyphW, &glyphH, &xoff, &yoff);
-	defer(stbtt_FreeBitmap(bitmap, nullptr));
-	if (atlasX + glyphW >= ATLAS_WIDTH) {
-		atlasX = 0;
-		atlasY += atlasRowHeight;
-		atlasRowHeight = 0;
+static uint16_t allocateSlot(char32_t cp) {
+	uint16_t slot;
+	if (!freeSlots.empty()) {
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+		slotOwners[slot] = cp;
+		permaAssertDevelopement(slotRefs[slot] == 0);
+	} else {
+		slot = static_cast<uint16_t>(slotOwners.size());
+		slotOwners.push_back(cp);
+		slotRefs.push_back(0);
 	}
+	return slot;
+}
 
-	if (atlasY + glyphH >= ATLAS_HEIGHT) {
-		return false; // atlas full
+static void writeGlyphTable(const Glyph& g) {
+	size_t at = size_t(g.slot) * 12;
+	if (glyphTable.size() < at + 12) {
+		glyphTable.resize(at + 12);
 	}
+	float u1 = g.tx + g.bw / ATLAS_WIDTH;
+	float v1 = g.ty + g.bh / ATLAS_HEIGHT;
+	const float entry[12] = {g.bl, g.bt, g.bw, g.bh, g.tx, g.ty, u1, v1, float(g.page), 0.0f, 0.0f, 0.0f};
+	memcpy(glyphTable.data() + at, entry, sizeof(entry));
+	glyphTableChanged = true;
+}
 
-	for (int i = 0; i < glyphH; i++) {
-		memcpy(atlasBitmap + (atlasY + i) * ATLAS_WIDTH + atlasX, bitmap + i * glyphW, glyphW);
+static void markAtlasDirty(AtlasPage& page, int x, int y, int w, int h) {
+	page.dirtyX0 = std::min(page.dirtyX0, x);
+	page.dirtyY0 = std::min(page.dirtyY0, y);
+	page.dirtyX1 = std::max(page.dirtyX1, x + w);
+	page.dirtyY1 = std::max(page.dirtyY1, y + h);
+}
+
+// Empties the page, the whole of it is uploaded again
+static void resetAtlasPage(AtlasPage& page) {
+	page.bitmap.assign(size_t(ATLAS_WIDTH) * ATLAS_HEIGHT, 0);
+	page.skyline.assign(1, SkylineNode{0, 0, ATLAS_WIDTH});
+	page.usedArea = 0;
+	markAtlasDirty(page, 0, 0, ATLAS_WIDTH, ATLAS_HEIGHT);
+}
+
+// Height a w wide rectangle would sit at with its left edge on node i, -1 if it runs past the right edge
+static int skylineFit(const std::vector<SkylineNode>& skyline, size_t i, int w) {
+	if (skyline[i].x + w > ATLAS_WIDTH) {
+		return -1;
+	}
+	int y = 0;
+	for (int left = w; left > 0; left -= skyline[i++].width) {
+		y = std::max(y, skyline[i].y);
 	}
+	return y;
+}
 
-	Glyph g;
-	g.ax = advance * scale;
-	g.ay = 0;
-	g.bw = (float)glyphW;
-	g.bh = (float)glyphH;
-	g.bl = (float)xoff;
-	g.bt = (float)yoff;
-	g.tx = (float)atlasX / ATLAS_WIDTH;
+// Skyline packing, bottom-left: the lowest spot, the narrowest node on ties. Glyphs are 1 pixel apart.
+// False if the page has no room left for w x h
+static bool allocateInPage(AtlasPage& page, int w, int h, int& x, int& y) {
+	w += 1;
+	h += 1;
+	std::vector<SkylineNode>& skyline = page.skyline;
+	size_t best = SIZE_MAX;
+	int bestY = ATLAS_HEIGHT;
+	int bestWidth = INT_MAX;
+	for (size_t i = 0; i < skyline.size(); ++i) {
+		int top = skylineFit(skyline, i, w);
+		if (top < 0 || top + h > ATLAS_HEIGHT) {
+			continue;
+		}
+		if (top < bestY || (top == bestY && skyline[i].width < bestWidth)) {
+			best = i;
+			bestY = top;
+			bestWidth = skyline[i].width;
+		}
+	}
+	if (best == SIZE_MAX) {
+		return false; // page full
+	}
 
-	glyphs[cp] = g;
+	x = skyline[best].x;
+	y = bestY;
+	skyline.insert(skyline.begin() + best, SkylineNode{x, y + h, w});
 
-	atlasX += glyphW + 1;
-	atlasRowHeight = std::max(atlasRowHeight, glyphH);
+	// Cut the nodes the new one covers
+	for (size_t i = best + 1; i < skyline.size();) {
+		int covered = x + w - skyline[i].x;
+		if (covered <= 0) {
+			break;
+		}
+		if (covered < skyline[i].width) {
+			skyline[i].x += covered;
+			skyline[i].width -= covered;
+			break;
+		}
+		skyline.erase(skyline.begin() + i);
+	}
+	// Join neighbours at the same height
+	for (size_t i = 0; i + 1 < skyline.size();) {
+		if (skyline[i].y == skyline[i + 1].y) {
+			skyline[i].width += skyline[i + 1].width;
+			skyline.erase(skyline.begin() + i + 1);
+		} else {
+			++i;
+		}
+	}
 
+	page.usedArea += size_t(w) * h;
 	return true;
 }
 
-static void loadGlyphIfNeeded(char32_t cp) {
-	if (glyphs.find(cp) != glyphs.end())
-		return;
+// Rasterizes the glyph straight into a free spot of the page and fills in its metrics, false if it doesn't fit
+static bool rasterizeGlyph(int pageIndex, int glyphIndex, Glyph& g) {
+	int x0, y0, x1, y1;
+	stbtt_GetGlyphBitmapBox(&fontInfo, glyphIndex, scale, scale, &x0, &y0, &x1, &y1);
+	int glyphW = x1 - x0;
+	int glyphH = y1 - y0;
 
-	if (!tryPackGlyph(cp)) {
-		if (glyphs.find('?') == glyphs.end())
-			tryPackGlyph('?');
-		glyphs[cp] = glyphs.at('?');
-		return;
+	AtlasPage& page = atlasPages[pageIndex];
+	int x, y;
+	if (!allocateInPage(page, glyphW, glyphH, x, y)) {
+		return false;
 	}
+	stbtt_MakeGlyphBitmap(&fontInfo, page.bitmap.data() + y * ATLAS_WIDTH + x, glyphW, glyphH, ATLAS_WIDTH, scale,
+						  scale, glyphIndex);
+	markAtlasDirty(page, x, y, glyphW, glyphH);
 
-	uploadAtlasTexture();
+	int advance, lsb;
+	stbtt_GetGlyphHMetrics(&fontInfo, glyphIndex, &advance, &lsb);
+	g.ax = advance * scale;
+	g.ay = 0;
+	g.bw = (float)glyphW;
+	g.bh = (float)glyphH;
+	g.bl = (float)x0;
+	g.bt = (float)y0;
+	g.tx = (float)x / ATLAS_WIDTH;
+	g.ty = (float)y / ATLAS_HEIGHT;
+	g.page = static_cast<uint8_t>(pageIndex);
+	return true;
 }
 
-static void buildAtlasIncremental(const std::vector<char32_t>& codepoints) {
-	int x = 0, y = 0, rowHeight = 0;
-
-	memset(atlasBitmap, 0, sizeof(atlasBitmap));
-	glyphs.clear();
+// Glyphs that are pinned, in a cached row or were put into a row this frame stay in the atlas
+static bool isEvictable(const Glyph& g) {
+	return !g.pinned && slotRefs[g.slot] == 0 && g.lastUsed < atlasFrame;
+}
 
-	for (char32_t cp : codepoints) {
-		int glyphIndex = stbtt_FindGlyphIndex(&fontInfo, cp);
-		if (glyphIndex == 0) {
-			// Skip missing glyphs
+// Evicts the evictable glyphs of the page that were last used before keepSince, and packs the others
+// again from scratch. Pinned glyphs have the lowest slots and are packed first, in the order they were packed
+// at startup, so they always fit
+static void repackAtlasPage(int pageIndex, uint32_t keepSince) {
+	resetAtlasPage(atlasPages[pageIndex]);
+	for (size_t slot = 0; slot < slotOwners.size(); ++slot) {
+		char32_t cp = slotOwners[slot];
+		if (cp == NoCodepoint) {
 			continue;
 		}
+		Glyph& g = glyphEntry(cp);
+		if (g.page != pageIndex) {
+			continue;
+		}
+		bool keep = !isEvictable(g) || g.lastUsed >= keepSince;
+		if (keep && rasterizeGlyph(pageIndex, stbtt_FindGlyphIndex(&fontInfo, cp), g)) {
+			writeGlyphTable(g);
+			continue;
+		}
+		permaAssertDevelopement(!g.pinned);
+		// Packed in another order the kept glyphs may not all fit again. Rare, the rows are rebuilt then
+		if (slotRefs[slot] > 0) {
+			atlasLostRowGlyph = true;
+		}
+		forgetGlyph(cp);
+		slotOwners[slot] = NoCodepoint;
+		freeSlots.push_back(static_cast<uint16_t>(slot));
+	}
+}
 
-		int advance, lsb;
-		stbtt_GetGlyphHMetrics(&fontInfo, glyphIndex, &advance, &lsb);
-
-		int glyphW, glyphH, xoff, yoff;
-		unsigned char* bitmap =
-			stbtt_GetGlyphBitmap(&fontInfo, scale, scale, glyphIndex, &glyphW, &glyphH, &xoff, &yoff);
-		defer(stbtt_FreeBitmap(bitmap, nullptr));
+// Makes room on the page holding the least recently used evictable glyph by evicting the older half of its
+// evictable glyphs. Returns the page, or -1 if every glyph is pinned or on screen
+static int evictFromAtlas() {
+	int victim = -1;
+	uint32_t oldest = atlasFrame;
+	for (char32_t cp : slotOwners) {
+		if (cp == NoCodepoint) {
+			continue;
+		}
+		const Glyph& g = glyphEntry(cp);
+		if (isEvictable(g) && g.lastUsed < oldest) {
+			oldest = g.lastUsed;
+			victim = g.page;
+		}
+	}
+	if (victim < 0) {
+		return -1;
+	}
 
-		if (x + glyphW >= ATLAS_WIDTH) {
-			x = 0;
-			y += rowHeight;
-			rowHeight = 0;
+	std::vector<uint32_t> stamps;
+	for (char32_t cp : slotOwners) {
+		if (cp == NoCodepoint) {
+			continue;
 		}
+		const Glyph& g = glyphEntry(cp);
+		if (g.page == victim && isEvictable(g)) {
+			stamps.push_back(g.lastUsed);
+		}
+	}
+	auto median = stamps.begin() + (stamps.size() - 1) / 2;
+	std::nth_element(stamps.begin(), median, stamps.end());
+	std::cout << "Glyph atlas full at " << int(getAtlasOccupancy() * 100.0f) << "% occupancy, evicting from page "
+			  << victim << "\n";
+	repackAtlasPage(victim, *median + 1);
+	return victim;
+}
 
-		permaAssert(y + glyphH < ATLAS_HEIGHT);
+// Packs cp into the first page with room, opening a new page or evicting old glyphs when they are all full.
+// False if the glyph doesn't fit even then
+static bool tryPackGlyph(char32_t cp, int glyphIndex, bool pinned) {
+	// Records keep the slot in 16 bits, NoSlot excluded
+	while (freeSlots.empty() && slotOwners.size() >= NoSlot) {
+		if (evictFromAtlas() < 0) {
+			return false;
+		}
+	}
 
-		for (int i = 0; i < glyphH; i++) {
-			memcpy(atlasBitmap + (y + i) * ATLAS_WIDTH + x, bitmap + i * glyphW, glyphW);
+	Glyph g{};
+	bool packed = false;
+	for (int p = 0; p < atlasPageCount && !packed; ++p) {
+		packed = rasterizeGlyph(p, glyphIndex, g);
+	}
+	if (!packed && atlasPageCount < ATLAS_PAGES) {
+		resetAtlasPage(atlasPages[atlasPageCount]);
+		packed = rasterizeGlyph(atlasPageCount++, glyphIndex, g);
+	}
+	while (!packed) {
+		int page = evictFromAtlas();
+		if (page < 0) {
+			return false;
 		}
+		packed = rasterizeGlyph(page, glyphIndex, g);
+	}
 
-		Glyph g;
-		g.ax = advance * scale;
-		g.ay = 0;
-		g.bw = (float)glyphW;
-		g.bh = (float)glyphH;
-		g.bl = (float)xoff;
-		g.bt = (float)yoff;
-		g.tx = (float)x / ATLAS_WIDTH;
+	g.pinned = pinned;
+	g.lastUsed = atlasFrame;
+	g.slot = allocateSlot(cp);
+	writeGlyphTable(g);
+	glyphEntry(cp) = g;
+	return true;
+}
 
-		glyphs[cp] = g;
+// Packs cp into the atlas. Codepoints the font doesn't have are shown as '?', and so are glyphs that find no
+// room in the atlas, until their row is drawn again
+static const Glyph& loadGlyph(char32_t cp, Glyph& entry) {
+	int glyphIndex = stbtt_FindGlyphIndex(&fontInfo, cp);
+	if (glyphIndex == 0) {
+		return entry = glyphEntry('?');
+	}
+	if (!tryPackGlyph(cp, glyphIndex, false)) {
+		return glyphEntry('?');
+	}
+	return entry;
+}
 
-		x += glyphW + 1;
-		if (glyphH > rowHeight)
-			rowHeight = glyphH;
+// The glyph of cp, marked used this frame
+static const Glyph& glyphFor(char32_t cp) {
+	Glyph& entry = glyphEntry(cp);
+	if (entry.slot == NoSlot) {
+		return loadGlyph(cp, entry);
 	}
+	entry.lastUsed = atlasFrame;
+	return entry;
+}
 
-	uploadAtlasTexture();
+// Packs the codepoints and pins them, they are never evicted
+static void buildAtlasIncremental(const std::vector<char32_t>& codepoints) {
+	for (char32_t cp : codepoints) {
+		int glyphIndex = stbtt_FindGlyphIndex(&fontInfo, cp);
+		if (glyphIndex == 0) {
+			// Skip missing glyphs
+			continue;
+		}
+		permaAssert(tryPackGlyph(cp, glyphIndex, true));
+	}
+}
 
-	// Initialize incremental packing state
-	atlasX = x;
-	atlasY = y;
-	atlasRowHeight = rowHeight;
+float getAtlasOccupancy() {
+	if (atlasPageCount == 0) {
+		return 0.0f;
+	}
+	size_t used = 0;
+	for (int p = 0; p < atlasPageCount; ++p) {
+		used += atlasPages[p].usedArea;
+	}
+	return float(used) / (float(atlasPageCount) * ATLAS_WIDTH * ATLAS_HEIGHT);
 }
 
-static void uploadAtlasTexture() {
-	if (atlasTexture == 0)
-		glGenTextures(1, &atlasTexture);
+static void clearAtlas() {
+	for (std::unique_ptr<Glyph[]>& page : bmpGlyphs) {
+		page.reset();
+	}
+	astralGlyphs.clear();
+	glyphTable.clear();
+	slotOwners.clear();
+	freeSlots.clear();
+	slotRefs.clear();
+	regionSlots.clear();
+	for (AtlasPage& page : atlasPages) {
+		page = AtlasPage{};
+	}
+	atlasPageCount = 0;
+}
 
-	glBindTexture(GL_TEXTURE_2D, atlasTexture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, ATLAS_WIDTH, ATLAS_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, atlasBitmap);
+// The storage for every page is allocated once, glyphs are uploaded into it by uploadAtlasTexture
+static void createAtlasTexture() {
+	glGenTextures(1, &atlasTexture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, atlasTexture);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8, ATLAS_WIDTH, ATLAS_HEIGHT, ATLAS_PAGES, 0, GL_RED, GL_UNSIGNED_BYTE,
+				 nullptr);
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+// Uploads the rectangle of each page that changed since the last call, if anything did
+static void uploadAtlasTexture() {
+	glBindTexture(GL_TEXTURE_2D_ARRAY, atlasTexture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, ATLAS_WIDTH);
+	for (int p = 0; p < atlasPageCount; ++p) {
+		AtlasPage& page = atlasPages[p];
+		if (page.dirtyX0 >= page.dirtyX1 || page.dirtyY0 >= page.dirtyY1) {
+			continue;
+		}
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, page.dirtyX0, page.dirtyY0, p, page.dirtyX1 - page.dirtyX0,
+						page.dirtyY1 - page.dirtyY0, 1, GL_RED, GL_UNSIGNED_BYTE,
+						page.bitmap.data() + page.dirtyY0 * ATLAS_WIDTH + page.dirtyX0);
+		page.dirtyX0 = ATLAS_WIDTH;
+		page.dirtyY0 = ATLAS_HEIGHT;
+		page.dirtyX1 = 0;
+		page.dirtyY1 = 0;
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 }
 
 void startRender() {
@@ -276,11 +646,21 @@ void startRender() {
 
 	stbtt_GetFontVMetrics(&fontInfo, &ascent, &descent, &lineGap);
 
-	memset(atlasBitmap, 0, sizeof(atlasBitmap));
-	glyphs.clear();
+	clearAtlas();
 	glGenVertexArrays(1, &vao);
 	glGenBuffers(1, &vbo);
-	shaderProgram = createShaderProgram();
+	shaderProgram = createShaderProgram(vertexShaderSrc);
+	cellProgram = createShaderProgram(cellVertexShaderSrc);
+
+	// Everything the cell shader reads comes from buffer textures, the VAO has no attributes
+	glGenVertexArrays(1, &cellVao);
+	for (RecordBuffer* records : {&glyphRecords, &backgroundRuns}) {
+		glGenBuffers(1, &records->buffer);
+		glGenTextures(1, &records->texture);
+	}
+
+	glGenBuffers(1, &glyphTableBuffer);
+	glGenTextures(1, &glyphTableTexture);
 
 	// Prebake ASCII range 32..126 at start
 	std::vector<char32_t> asciiRange;
@@ -288,9 +668,10 @@ void startRender() {
 		asciiRange.push_back(cp);
 	asciiRange.push_back(CURSOR_CODEPOINT);
 
+	createAtlasTexture();
 	buildAtlasIncremental(asciiRange);
 	uploadAtlasTexture();
-	glyphs['\0'] = glyphs.at(' ');
+	glyphEntry('\0') = glyphEntry(' ');
 
 	int glyphIndexSpace = stbtt_FindGlyphIndex(&fontInfo, ' ');
 	int advanceSpace, lsb;
@@ -299,110 +680,185 @@ void startRender() {
 	o.fontHeight = (float)(ascent - descent + lineGap) * scale;
 }
 
-void render(const std::vector<StyledLine>& screen, int screenW, int screenH) {
-	glViewport(0, 0, screenW, screenH);
-	glClear(GL_COLOR_BUFFER_BIT);
-
-	glUseProgram(shaderProgram);
-	defer(glUseProgram(0));
-	GLint screenSizeLoc = glGetUniformLocation(shaderProgram, "screenSize");
-	glUniform2f(screenSizeLoc, float(screenW), float(screenH));
+// Fills the glyph records and background runs of a row
+static void buildRow(StyledLine line, int cols, std::vector<GlyphRecord>& glyphsOut,
+					 std::vector<BackgroundRun>& runsOut) {
+	glyphsOut.clear();
+	runsOut.clear();
+	bool inRun = false;
+	size_t count = std::min<size_t>(line.size(), cols);
+	for (size_t i = 0; i < count; ++i) {
+		StyledChar stc = line[i];
+		const CellStyle& style = o.screen.getStyle(stc.style);
+		TermColor fg = o.palette.resolve(style.fg, true);
+		TermColor bg = o.palette.resolve(style.bg, false);
+		bool inverse = style.attr.has(TextAttribute::Inverse);
+		if (inverse) {
+			// Inverse colors
+			fg = TermColor{255 - fg.r, 255 - fg.g, 255 - fg.b};
+			bg = TermColor{255 - bg.r, 255 - bg.g, 255 - bg.b};
+		}
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, atlasTexture);
-	GLint texLoc = glGetUniformLocation(shaderProgram, "tex");
-	glUniform1i(texLoc, 0);
+		if (inverse || style.bg.kind != ColorKind::Default) {
+			uint32_t color = packRGB(bg);
+			if (inRun && runsOut.back().color == color) {
+				runsOut.back().length++;
+			} else {
+				runsOut.push_back({static_cast<uint16_t>(i), 1, color});
+			}
+			inRun = true;
+		} else {
+			inRun = false;
+		}
 
-	glBindVertexArray(vao);
-	defer(glBindVertexArray(0));
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		if (stc.ch == ' ' || stc.ch == '\0' || stc.ch == '\r')
+			continue;
 
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, u));
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, r));
+		const Glyph& g = glyphFor(stc.ch);
+		glyphsOut.push_back({static_cast<uint16_t>(i), g.slot, packRGB(fg)});
+	}
+}
 
-	std::vector<Vertex> vertices;
-	float lineHeight = (ascent - descent + lineGap) * scale;
-	float yStart = 0;
-
-	for (int lineIndex = 0; lineIndex < screen.size(); ++lineIndex) {
-		float penX = 0;
-		float baselineY = yStart + ascent * scale + lineIndex * lineHeight;
-		StyledLine line = screen[lineIndex];
-		for (StyledChar stc : line) {
-			if (stc.ch == '\r')
-				continue;
-
-			loadGlyphIfNeeded(stc.ch);
-			const Glyph& g = glyphs.at(stc.ch);
-
-			float x0 = std::round(penX + g.bl);
-			float y0 = std::round(baselineY + g.bt);
-			float x1 = x0 + g.bw;
-			float y1 = y0 + g.bh;
-			
-			if(stc.attr.has(TextAttribute::Inverse)) {
-				// Inverse colors
-				stc.fg = TermColor{255 - stc.fg.r, 255 - stc.fg.g, 255 - stc.fg.b};
-				stc.bg = TermColor{255 - stc.bg.r, 255 - stc.bg.g, 255 - stc.bg.b};
-			}
+template <typename Record>
+static void uploadRegion(RecordBuffer& records, int region, const std::vector<Record>& data) {
+	glBindBuffer(GL_TEXTURE_BUFFER, records.buffer);
+	glBufferSubData(GL_TEXTURE_BUFFER, size_t(region) * regionCols * sizeof(Record), data.size() * sizeof(Record),
+					data.data());
+	records.vertexCount[region] = static_cast<GLsizei>(data.size() * 6);
+}
 
-			if (stc.bg != TermColor::DefaultBackGround()) {
-				float bgX0 = penX;
-				float bgY0 = baselineY - ascent * scale;
-				float bgX1 = bgX0 + o.fontWidth;
-				float bgY1 = bgY0 + o.fontHeight;
-
-				vec4 bgColor = termColorToRGBA(stc.bg);
-				vertices.push_back({bgX0, bgY0, 0, 0, bgColor.r, bgColor.g, bgColor.b, bgColor.a});
-				vertices.push_back({bgX1, bgY0, 0, 0, bgColor.r, bgColor.g, bgColor.b, bgColor.a});
-				vertices.push_back({bgX0, bgY1, 0, 0, bgColor.r, bgColor.g, bgColor.b, bgColor.a});
-				vertices.push_back({bgX1, bgY0, 0, 0, bgColor.r, bgColor.g, bgColor.b, bgColor.a});
-				vertices.push_back({bgX1, bgY1, 0, 0, bgColor.r, bgColor.g, bgColor.b, bgColor.a});
-				vertices.push_back({bgX0, bgY1, 0, 0, bgColor.r, bgColor.g, bgColor.b, bgColor.a});
-			}
+static void releaseRegionSlots(int region) {
+	for (uint16_t slot : regionSlots[region]) {
+		slotRefs[slot]--;
+	}
+	regionSlots[region].clear();
+}
 
-			float tx0 = g.tx;
-			float tx1 = tx0 + g.bw / ATLAS_WIDTH;
-			float ty0 = 0.0f;
-			float ty1 = g.bh / ATLAS_HEIGHT;
-			vec4 fgColor = termColorToRGBA(stc.fg);
+// The glyphs the region held before can be evicted while the row is built, the ones it puts in are used this frame
+static void rebuildRegion(StyledLine line, int region, int cols) {
+	releaseRegionSlots(region);
+	buildRow(line, cols, rowGlyphs, rowRuns);
+	for (const GlyphRecord& record : rowGlyphs) {
+		regionSlots[region].push_back(record.glyph);
+		slotRefs[record.glyph]++;
+	}
+	uploadRegion(glyphRecords, region, rowGlyphs);
+	uploadRegion(backgroundRuns, region, rowRuns);
+}
 
-			vertices.push_back({x0, y0, tx0, ty0, fgColor.r, fgColor.g, fgColor.b, fgColor.a});
-			vertices.push_back({x1, y0, tx1, ty0, fgColor.r, fgColor.g, fgColor.b, fgColor.a});
-			vertices.push_back({x0, y1, tx0, ty1, fgColor.r, fgColor.g, fgColor.b, fgColor.a});
-			vertices.push_back({x1, y0, tx1, ty0, fgColor.r, fgColor.g, fgColor.b, fgColor.a});
-			vertices.push_back({x1, y1, tx1, ty1, fgColor.r, fgColor.g, fgColor.b, fgColor.a});
-			vertices.push_back({x0, y1, tx0, ty1, fgColor.r, fgColor.g, fgColor.b, fgColor.a});
+static void drawRecords(const RecordBuffer& records, bool backgroundPass) {
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_BUFFER, records.texture);
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(glGetUniformLocation(cellProgram, "backgroundPass"), backgroundPass);
+	glMultiDrawArrays(GL_TRIANGLES, records.first.data(), records.vertexCount.data(), regionRows);
+}
 
-			penX += g.ax;
-		}
+static void uploadGlyphTable() {
+	if (!glyphTableChanged) {
+		return;
 	}
-	// TOFIX: Segfault when exiting nano
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_DYNAMIC_DRAW);
-	glDrawArrays(GL_TRIANGLES, 0, (GLsizei)vertices.size());
+	glBindBuffer(GL_TEXTURE_BUFFER, glyphTableBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, glyphTable.size() * sizeof(float), glyphTable.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_BUFFER, glyphTableTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, glyphTableBuffer);
+	glyphTableChanged = false;
 }
 
-void renderCursor(int cursorX, int cursorY, float deltaTime, int screenW, int screenH) {
-	bool visible = true;
-	if (o.flags.has(TermFlags::CURSOR_BLINK)) {
-		static float time = 0.0f;
-		time += deltaTime;
+void render(const std::vector<StyledLine>& screen, int screenW, int screenH) {
+	glViewport(0, 0, screenW, screenH);
+	// Default background cells are not drawn, they show the clear color. It stays transparent until OSC 11
+	// changes it so the window backdrop shows through
+	TermColor background = o.palette.background;
+	float backgroundAlpha = background == Palette::DefaultBackground ? 0.0f : 1.0f;
+	glClearColor(background.r / 255.0f, background.g / 255.0f, background.b / 255.0f, backgroundAlpha);
+	glClear(GL_COLOR_BUFFER_BIT);
 
-		// Blink on/off every 0.5s
-		visible = fmod(time, 1.0f) < 0.5f;
-		if (!visible)
-			return;
+	int rows = static_cast<int>(screen.size());
+	int cols = o.screen.get_width();
+	if (rows == 0 || cols == 0) {
+		return;
+	}
+	bool rebuildAll = false;
+	if (rows != regionRows || cols != regionCols) {
+		regionRows = rows;
+		regionCols = cols;
+		rowBase = 0;
+		for (RecordBuffer* records : {&glyphRecords, &backgroundRuns}) {
+			// Both kinds of records are 8 bytes
+			glBindBuffer(GL_TEXTURE_BUFFER, records->buffer);
+			glBufferData(GL_TEXTURE_BUFFER, size_t(rows) * cols * sizeof(GlyphRecord), nullptr, GL_DYNAMIC_DRAW);
+			glBindTexture(GL_TEXTURE_BUFFER, records->texture);
+			glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, records->buffer);
+			records->first.resize(rows);
+			records->vertexCount.assign(rows, 0);
+			for (int r = 0; r < rows; ++r) {
+				records->first[r] = r * cols * 6;
+			}
+		}
+		for (size_t r = 0; r < regionSlots.size(); ++r) {
+			releaseRegionSlots(static_cast<int>(r));
+		}
+		regionSlots.resize(rows);
+		rebuildAll = true;
+	}
+	// Scrolled back the lines are not the screen's rows, its damage doesn't apply
+	bool scrolledBack = o.scrollbackOffset != 0;
+	rebuildAll |= scrolledBack || wasScrolledBack;
+	wasScrolledBack = scrolledBack;
+	if (!rebuildAll) {
+		rowBase = ((rowBase + o.screen.getScrollDelta()) % rows + rows) % rows;
 	}
 
-	auto it = glyphs.find(CURSOR_CODEPOINT);
-	if (it == glyphs.end())
-		return;
+	atlasFrame++;
+	atlasLostRowGlyph = false;
+	for (int y = 0; y < rows; ++y) {
+		if (!rebuildAll && !o.screen.isRowDirty(y)) {
+			continue;
+		}
+		rebuildRegion(screen[y], (y + rowBase) % rows, cols);
+	}
+	if (atlasLostRowGlyph) {
+		for (int y = 0; y < rows; ++y) {
+			rebuildRegion(screen[y], (y + rowBase) % rows, cols);
+		}
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	o.screen.clearDamage();
+	// The glyphs the rows above packed go up in one upload
+	uploadAtlasTexture();
+	uploadGlyphTable();
+
+	glUseProgram(cellProgram);
+	defer(glUseProgram(0));
+	glBindVertexArray(cellVao);
+	defer(glBindVertexArray(0));
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, atlasTexture);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_BUFFER, glyphTableTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(glGetUniformLocation(cellProgram, "tex"), 0);
+	glUniform1i(glGetUniformLocation(cellProgram, "glyphTable"), 1);
+	glUniform1i(glGetUniformLocation(cellProgram, "records"), 2);
+	glUniform2f(glGetUniformLocation(cellProgram, "screenSize"), float(screenW), float(screenH));
+	glUniform2f(glGetUniformLocation(cellProgram, "cellSize"), o.fontWidth, o.fontHeight);
+	glUniform1f(glGetUniformLocation(cellProgram, "ascent"), ascent * scale);
+	glUniform1i(glGetUniformLocation(cellProgram, "cols"), cols);
+	glUniform1f(glGetUniformLocation(cellProgram, "rowBase"), float(rowBase));
+	glUniform1f(glGetUniformLocation(cellProgram, "regionCount"), float(rows));
+
+	// Backgrounds first, glyphs blend over them
+	drawRecords(backgroundRuns, true);
+	drawRecords(glyphRecords, false);
+}
 
-	const Glyph& g = it->second;
+// Blinking is decided by the caller, this only draws
+void renderCursor(int cursorX, int cursorY, int screenW, int screenH) {
+	const Glyph& g = glyphEntry(CURSOR_CODEPOINT);
+	if (g.slot == NoSlot)
+		return;
 
 	float cursorWidth = 2.0f;
 	float offsetX = 0.2f; // Shift left or right by modifying this value (pixels)
@@ -421,10 +877,10 @@ void renderCursor(int cursorX, int cursorY, float deltaTime, int screenW, int sc
 	float tx0 = g.tx;
 	float tx1 = tx0 + (cursorWidth / g.bw) * (g.bw / ATLAS_WIDTH);
 
-	float ty0 = 0.0f;
-	float ty1 = g.bh / ATLAS_HEIGHT;
+	float ty0 = g.ty;
+	float ty1 = ty0 + g.bh / ATLAS_HEIGHT;
 
-	constexpr vec4 color = termColorToRGBA(TermColor::DefaultForeGround());
+	vec4 color = termColorToRGBA(o.palette.foreground);
 	Vertex verts[6] = {
 		{x0, y0, tx0, ty0, color.r, color.g, color.b, color.a}, {x1, y0, tx1, ty0, color.r, color.g, color.b, color.a},
 		{x0, y1, tx0, ty1, color.r, color.g, color.b, color.a}, {x1, y0, tx1, ty0, color.r, color.g, color.b, color.a},
@@ -438,9 +894,10 @@ void renderCursor(int cursorX, int cursorY, float deltaTime, int screenW, int sc
 
 	glUniform2f(screenSizeLoc, float(screenW), float(screenH));
 	glUniform1i(texLoc, 0);
+	glUniform1f(glGetUniformLocation(shaderProgram, "layer"), float(g.page));
 
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, atlasTexture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, atlasTexture);
 
 	glBindVertexArray(vao);
 	defer(glBindVertexArray(0));
@@ -461,6 +918,16 @@ void stopRender() {
 	glDeleteBuffers(1, &vbo);
 	glDeleteVertexArrays(1, &vao);
 	glDeleteProgram(shaderProgram);
+	for (RecordBuffer* records : {&glyphRecords, &backgroundRuns}) {
+		glDeleteBuffers(1, &records->buffer);
+		glDeleteTextures(1, &records->texture);
+	}
+	glDeleteVertexArrays(1, &cellVao);
+	glDeleteProgram(cellProgram);
+	glDeleteTextures(1, &glyphTableTexture);
+	glDeleteBuffers(1, &glyphTableBuffer);
+	regionRows = 0;
+	regionCols = 0;
 	if (ttfBuffer) {
 		delete[] ttfBuffer;
 		ttfBuffer = nullptr;
@@ -469,5 +936,5 @@ void stopRender() {
 		glDeleteTextures(1, &atlasTexture);
 		atlasTexture = 0;
 	}
-	glyphs.clear();
+	clearAtlas();
 }
@@ -0,0 +1,532 @@
+#include "scrollback.h"
+#include <algorithm>
+#include <cstring>
+#include <platform/tools.h>
+
+Scrollback::Scrollback(size_t budgetBytes, size_t spillBudgetBytes) : budget(budgetBytes), spillBudget(spillBudgetBytes) {
+}
+
+Scrollback::~Scrollback() {
+	closeSegments();
+}
+
+void Scrollback::push(const StyledChar* cells, size_t len, bool wrapped) {
+	len = std::min(len, MaxLineCells);
+	while (!wrapped && len > 0 && cells[len - 1].isBlank()) {
+		len--;
+	}
+
+	uint16_t runs = 0;
+	bool wide = false;
+	for (size_t i = 0; i < len; ++i) {
+		if (i == 0 || cells[i].style != cells[i - 1].style) {
+			runs++;
+		}
+		wide |= cells[i].ch > 0xFF;
+	}
+	size_t bytes = runs * RunBytes + len * (wide ? sizeof(char32_t) : 1);
+
+	reserveHandle();
+	if (writeBlock == NoBlock || writeOffset + bytes > BlockBytes) {
+		startBlock();
+	}
+
+	Block& block = blocks[writeBlock];
+	unsigned char* out = block.bytes.get() + writeOffset;
+	for (size_t i = 0; i < len;) {
+		size_t end = i + 1;
+		while (end < len && cells[end].style == cells[i].style) {
+			end++;
+		}
+		uint16_t runLength = static_cast<uint16_t>(end - i);
+		addStyle(cells[i].style);
+		memcpy(out, &cells[i].style, sizeof(uint32_t));
+		memcpy(out + sizeof(uint32_t), &runLength, sizeof(uint16_t));
+		out += RunBytes;
+		i = end;
+	}
+	for (size_t i = 0; i < len; ++i) {
+		if (wide) {
+			memcpy(out, &cells[i].ch, sizeof(char32_t));
+			out += sizeof(char32_t);
+		} else {
+			*out++ = static_cast<unsigned char>(cells[i].ch);
+		}
+	}
+	block.liveLines++;
+
+	size_t slot = first + count;
+	if (slot >= lines.size()) {
+		slot -= lines.size();
+	}
+	// Making room above may have dropped lines, including the one this continues
+	bool continues = count > 0 && line(count - 1).wrapped;
+	lines[slot] = Line{writeBlock, writeOffset, static_cast<uint16_t>(len), runs, wide, wrapped};
+	writeOffset += static_cast<uint32_t>(bytes);
+
+	if (continues) {
+		countLogicalLine(backCells, false);
+		backCells += len;
+		countLogicalLine(backCells, true);
+		if (closedLines == 0) {
+			frontCells = backCells; // the oldest logical line is the newest one
+		}
+	} else {
+		backCells = len;
+		countLogicalLine(backCells, true);
+		if (count == 0) {
+			frontCells = backCells;
+		}
+	}
+	closedLines += !wrapped;
+	count++;
+}
+
+void Scrollback::clear() {
+	closeSegments();
+	freeBlocks.clear();
+	releasedBlocks.clear();
+	for (uint32_t i = 0; i < blocks.size(); ++i) {
+		blocks[i].liveLines = 0;
+		blocks[i].segment = -1;
+		blocks[i].styles.clear();
+		(blocks[i].bytes ? freeBlocks : releasedBlocks).push_back(i);
+	}
+	liveBlocks.clear();
+	spilledBlocks = 0;
+	dropped += count;
+	first = 0;
+	count = 0;
+	lineLengths.clear();
+	closedLines = 0;
+	frontCells = 0;
+	backCells = 0;
+	totalRows = 0;
+	anchor = RowAnchor{};
+	rowCacheLine = NoLine;
+	writeBlock = NoBlock;
+	writeOffset = 0;
+	std::fill(styleRefs.begin(), styleRefs.end(), 0);
+}
+
+void Scrollback::setBudget(size_t budgetBytes) {
+	budget = budgetBytes;
+	releaseFreeBlocks();
+	while (count > 0 && memoryUsed() > budget) {
+		if (std::unique_ptr<unsigned char[]> spilled = spillOldest()) {
+			allocatedBlocks--;
+			continue;
+		}
+		popFront();
+		releaseFreeBlocks();
+	}
+}
+
+void Scrollback::setSpillBudget(size_t spillBudgetBytes) {
+	spillBudget = spillBudgetBytes;
+	// Spilled blocks are the oldest ones, so dropping lines frees them first
+	while (count > 0 && spilledBytes() > spillBudget) {
+		popFront();
+	}
+	releaseFreeBlocks();
+}
+
+size_t Scrollback::memoryUsed() const {
+	return allocatedBlocks * BlockBytes + lines.capacity() * sizeof(Line);
+}
+
+StyledLine Scrollback::read(size_t idx, std::vector<StyledChar>& out) const {
+	const Line& l = line(idx);
+	const unsigned char* in = blockData(l.block);
+	if (!in) {
+		out.clear();
+		return StyledLine();
+	}
+	in += l.offset;
+	out.resize(l.cells);
+	const unsigned char* chars = in + l.runs * RunBytes;
+	size_t cell = 0;
+	for (int r = 0; r < l.runs; ++r, in += RunBytes) {
+		uint32_t style;
+		uint16_t runLength;
+		memcpy(&style, in, sizeof(style));
+		memcpy(&runLength, in + sizeof(uint32_t), sizeof(runLength));
+		for (size_t end = cell + runLength; cell < end; ++cell) {
+			char32_t ch;
+			if (l.wide) {
+				memcpy(&ch, chars + cell * sizeof(char32_t), sizeof(char32_t));
+			} else {
+				ch = chars[cell];
+			}
+			out[cell] = StyledChar{ch, style};
+		}
+	}
+	return StyledLine(out.data(), out.size());
+}
+
+void Scrollback::takeOpenLine(std::vector<StyledChar>& out) {
+	out.clear();
+	// Only lines in the block being written to can be taken back, nothing was written after them
+	size_t from = count;
+	while (from > 0 && line(from - 1).wrapped && line(from - 1).block == writeBlock) {
+		from--;
+	}
+	if (from == count) {
+		return;
+	}
+	for (size_t i = from; i < count; ++i) {
+		read(i, decodeScratch);
+		out.insert(out.end(), decodeScratch.begin(), decodeScratch.end());
+	}
+
+	size_t openStart = logicalLineStart(count - 1);
+	if (anchor.line != NoLine && anchor.line - dropped >= openStart) {
+		anchor = RowAnchor{};
+	}
+	rowCacheLine = NoLine;
+	countLogicalLine(backCells, false);
+	writeOffset = line(from).offset;
+	blocks[writeBlock].liveLines -= static_cast<uint32_t>(count - from);
+	count = from;
+	size_t last;
+	if (openStart < from) {
+		// The start of the line was in an older block and stays
+		backCells = logicalLineCells(openStart, &last);
+		countLogicalLine(backCells, true);
+	} else {
+		backCells = count > 0 ? logicalLineCells(logicalLineStart(count - 1), &last) : 0;
+	}
+	if (closedLines == 0) {
+		frontCells = backCells;
+	}
+}
+
+size_t Scrollback::rowCount(int width) {
+	if (width != rowWidth) {
+		rowWidth = width;
+		totalRows = 0;
+		for (const auto& [cells, lineCount] : lineLengths) {
+			totalRows += rowsFor(cells, width) * lineCount;
+		}
+		anchor = RowAnchor{};
+	}
+	return totalRows;
+}
+
+StyledLine Scrollback::readRow(size_t row, int width, std::vector<StyledChar>& out) {
+	if (row >= rowCount(width)) {
+		out.clear();
+		return StyledLine();
+	}
+
+	// Walk from whichever of the anchor, the oldest and the newest logical line is closest
+	size_t start = 0;
+	size_t before = 0;
+	auto distance = [&](size_t rows) { return rows > row ? rows - row : row - rows; };
+	size_t backStart = logicalLineStart(count - 1);
+	size_t backBefore = totalRows - rowsFor(backCells, width);
+	if (distance(backBefore) < distance(before)) {
+		start = backStart;
+		before = backBefore;
+	}
+	if (anchor.line != NoLine && distance(anchor.rowsBefore) < distance(before)) {
+		start = anchor.line - dropped;
+		before = anchor.rowsBefore;
+	}
+	size_t last;
+	size_t cells = logicalLineCells(start, &last);
+	while (row < before) {
+		start = logicalLineStart(start - 1);
+		cells = logicalLineCells(start, &last);
+		before -= rowsFor(cells, width);
+	}
+	while (row >= before + rowsFor(cells, width)) {
+		before += rowsFor(cells, width);
+		start = last + 1;
+		cells = logicalLineCells(start, &last);
+	}
+	anchor = RowAnchor{start + dropped, before};
+
+	// A logical line usually spans a few rows in a row, decode it once
+	if (rowCacheLine != start + dropped || rowCache.size() != cells) {
+		rowCache.clear();
+		for (size_t i = start; i <= last; ++i) {
+			read(i, decodeScratch);
+			rowCache.insert(rowCache.end(), decodeScratch.begin(), decodeScratch.end());
+		}
+		rowCacheLine = start + dropped;
+	}
+	size_t from = std::min((row - before) * width, rowCache.size());
+	size_t to = std::min(from + width, rowCache.size());
+	out.assign(rowCache.begin() + from, rowCache.begin() + to);
+	return StyledLine(out.data(), out.size());
+}
+
+void Scrollback::countLogicalLine(size_t cells, bool add) {
+	if (add) {
+		lineLengths[cells]++;
+		totalRows += rowsFor(cells, rowWidth);
+		return;
+	}
+	auto it = lineLengths.find(cells);
+	permaAssertDevelopement(it != lineLengths.end());
+	if (--it->second == 0) {
+		lineLengths.erase(it);
+	}
+	totalRows -= rowsFor(cells, rowWidth);
+}
+
+size_t Scrollback::logicalLineCells(size_t idx, size_t* last) const {
+	size_t cells = line(idx).cells;
+	while (line(idx).wrapped && idx + 1 < count) {
+		cells += line(++idx).cells;
+	}
+	*last = idx;
+	return cells;
+}
+
+size_t Scrollback::logicalLineStart(size_t idx) const {
+	while (idx > 0 && line(idx - 1).wrapped) {
+		idx--;
+	}
+	return idx;
+}
+
+const Scrollback::Line& Scrollback::line(size_t idx) const {
+	size_t slot = first + idx;
+	if (slot >= lines.size()) {
+		slot -= lines.size();
+	}
+	return lines[slot];
+}
+
+unsigned char* Scrollback::blockData(uint32_t block) const {
+	const Block& b = blocks[block];
+	if (b.bytes) {
+		return b.bytes.get();
+	}
+	for (const Mapping& mapping : mappings) {
+		if (mapping.block == block) {
+			return mapping.address;
+		}
+	}
+	if (b.segment < 0) {
+		return nullptr;
+	}
+	Mapping& mapping = mappings[nextMapping];
+	nextMapping = (nextMapping + 1) % MappedBlocks;
+	if (mapping.block != NoBlock) {
+		platform::TempFile::unmap(mapping.address, BlockBytes);
+	}
+	platform::TempFile& file = *segments[b.segment].file;
+	mapping.address = static_cast<unsigned char*>(file.map(uint64_t(b.slot) * BlockBytes, BlockBytes));
+	mapping.block = mapping.address ? block : NoBlock;
+	return mapping.address;
+}
+
+void Scrollback::popFront() {
+	const Line l = lines[first];
+	blocks[l.block].liveLines--;
+	first = first + 1 == lines.size() ? 0 : first + 1;
+	count--;
+	// The block being written to is recycled when writing moves on from it
+	if (blocks[l.block].liveLines == 0 && l.block != writeBlock) {
+		retireBlock(l.block);
+	}
+
+	size_t oldRows = rowsFor(frontCells, rowWidth);
+	size_t popped = dropped++;
+	countLogicalLine(frontCells, false);
+	bool rest = l.wrapped && count > 0; // the rest of the logical line stays
+	if (rest) {
+		frontCells -= l.cells;
+		countLogicalLine(frontCells, true);
+		if (closedLines == 0) {
+			backCells = frontCells;
+		}
+	} else {
+		closedLines -= !l.wrapped;
+		size_t last;
+		frontCells = count > 0 ? logicalLineCells(0, &last) : 0;
+		if (count == 0) {
+			backCells = 0;
+		}
+	}
+
+	if (anchor.line == popped) {
+		anchor.line = rest ? popped + 1 : NoLine;
+	} else if (anchor.line != NoLine) {
+		anchor.rowsBefore -= oldRows - (rest ? rowsFor(frontCells, rowWidth) : 0);
+	}
+}
+
+void Scrollback::retireBlock(uint32_t block) {
+	// Lines leave in order, so the block that just emptied is the oldest one
+	permaAssertDevelopement(!liveBlocks.empty() && liveBlocks.front() == block);
+	liveBlocks.pop_front();
+	Block& b = blocks[block];
+	for (uint32_t style : b.styles) {
+		styleRefs[style]--;
+	}
+	b.styles.clear();
+	if (b.bytes) {
+		freeBlocks.push_back(block);
+		return;
+	}
+	unmapBlock(block);
+	Segment& segment = segments[b.segment];
+	segment.live--;
+	// A segment that can't take new blocks anymore is deleted with its last block
+	if (segment.live == 0 && segment.written == SegmentBlocks) {
+		segment.file.reset();
+	}
+	b.segment = -1;
+	spilledBlocks--;
+	releasedBlocks.push_back(block);
+}
+
+void Scrollback::startBlock() {
+	uint32_t previous = writeBlock;
+	// From here on the previous block is recycled like any other once its last line is dropped
+	writeBlock = NoBlock;
+	if (previous != NoBlock && blocks[previous].liveLines == 0) {
+		retireBlock(previous);
+	}
+
+	// Grow while the budget allows, after that the oldest block goes to disk or its lines are dropped
+	uint32_t block = NoBlock;
+	std::unique_ptr<unsigned char[]> buffer;
+	while (block == NoBlock && !buffer) {
+		if (!freeBlocks.empty()) {
+			block = freeBlocks.back();
+			freeBlocks.pop_back();
+		} else if (allocatedBlocks < 2 || memoryUsed() + BlockBytes <= budget || count == 0) {
+			buffer = std::make_unique<unsigned char[]>(BlockBytes);
+			allocatedBlocks++;
+		} else if (!(buffer = spillOldest())) {
+			popFront();
+		}
+	}
+	if (buffer) {
+		if (!releasedBlocks.empty()) {
+			block = releasedBlocks.back();
+			releasedBlocks.pop_back();
+		} else {
+			block = static_cast<uint32_t>(blocks.size());
+			blocks.emplace_back();
+		}
+		blocks[block].bytes = std::move(buffer);
+	}
+	writeBlock = block;
+	writeOffset = 0;
+	blockSerial++;
+	liveBlocks.push_back(block);
+}
+
+void Scrollback::addStyle(uint32_t style) {
+	if (style >= styleRefs.size()) {
+		styleRefs.resize(style + 1, 0);
+		styleLastBlock.resize(style + 1, 0);
+	}
+	// Serials start at 1, a style never added has 0
+	if (styleLastBlock[style] == blockSerial) {
+		return;
+	}
+	styleLastBlock[style] = blockSerial;
+	styleRefs[style]++;
+	blocks[writeBlock].styles.push_back(style);
+}
+
+std::unique_ptr<unsigned char[]> Scrollback::spillOldest() {
+	if (spillBudget < BlockBytes) {
+		return nullptr;
+	}
+	uint32_t victim = NoBlock;
+	for (uint32_t block : liveBlocks) {
+		if (blocks[block].bytes && block != writeBlock) {
+			victim = block;
+			break;
+		}
+	}
+	if (victim == NoBlock) {
+		return nullptr;
+	}
+	// Make room on disk by dropping the oldest lines, which are the ones on disk
+	while (spilledBytes() + BlockBytes > spillBudget) {
+		if (liveBlocks.front() == victim) {
+			return nullptr;
+		}
+		popFront();
+		if (!freeBlocks.empty()) {
+			return nullptr; // a block in memory emptied, no need to spill
+		}
+	}
+
+	if (segments.empty() || segments.back().written == SegmentBlocks) {
+		Segment segment;
+		segment.file = std::make_unique<platform::TempFile>();
+		if (!segment.file->open()) {
+			spillBudget = 0; // no usable temp directory, keep everything in memory from now on
+			return nullptr;
+		}
+		segments.push_back(std::move(segment));
+	}
+	Segment& segment = segments.back();
+	Block& b = blocks[victim];
+	if (!segment.file->write(uint64_t(segment.written) * BlockBytes, b.bytes.get(), BlockBytes)) {
+		spillBudget = 0;
+		return nullptr;
+	}
+	b.segment = static_cast<int32_t>(segments.size() - 1);
+	b.slot = segment.written;
+	segment.written++;
+	segment.live++;
+	spilledBlocks++;
+	return std::move(b.bytes);
+}
+
+void Scrollback::unmapBlock(uint32_t block) const {
+	for (Mapping& mapping : mappings) {
+		if (mapping.block == block) {
+			platform::TempFile::unmap(mapping.address, BlockBytes);
+			mapping = Mapping{};
+		}
+	}
+}
+
+void Scrollback::closeSegments() {
+	for (Mapping& mapping : mappings) {
+		if (mapping.block != NoBlock) {
+			platform::TempFile::unmap(mapping.address, BlockBytes);
+			mapping = Mapping{};
+		}
+	}
+	segments.clear();
+}
+
+void Scrollback::reserveHandle() {
+	if (count < lines.size()) {
+		return;
+	}
+	size_t grown = std::max<size_t>(lines.size() * 2, 1024);
+	if (count > 0 && allocatedBlocks * BlockBytes + grown * sizeof(Line) > budget) {
+		popFront(); // the ring is as large as the budget allows, reuse the oldest handle
+		return;
+	}
+	// Unwrap the ring into the new storage
+	std::vector<Line> resized(grown);
+	for (size_t i = 0; i < count; ++i) {
+		resized[i] = line(i);
+	}
+	lines = std::move(resized);
+	first = 0;
+}
+
+void Scrollback::releaseFreeBlocks() {
+	for (uint32_t block : freeBlocks) {
+		blocks[block].bytes.reset();
+		allocatedBlocks--;
+		releasedBlocks.push_back(block);
+	}
+	freeBlocks.clear();
+}
@@ -0,0 +1,109 @@
+#include "simdScan.h"
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TEM_SCAN_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TEM_SCAN_SSE2 1
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace
+{
+inline bool isPrintableAscii(unsigned char c) {
+	return c >= 0x20 && c < 0x7F;
+}
+
+inline bool isControl(unsigned char c) {
+	return c < 0x20 || c == 0x7F;
+}
+
+inline unsigned countTrailingZeros(uint32_t mask) {
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, mask);
+	return idx;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+}
+
+size_t findNonPrintableAscii(const char* data, size_t len) {
+	size_t i = 0;
+
+	// As signed bytes everything >= 0x80 is negative, so a single "greater than 0x1F" catches both
+	// the C0 range and non-ASCII, only DEL needs a separate compare.
+#ifdef TEM_SCAN_AVX2
+	const __m256i below32 = _mm256_set1_epi8(0x1F);
+	const __m256i del = _mm256_set1_epi8(0x7F);
+	for (; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+		__m256i printable = _mm256_andnot_si256(_mm256_cmpeq_epi8(chunk, del), _mm256_cmpgt_epi8(chunk, below32));
+		uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(printable));
+		if (mask != 0)
+			return i + countTrailingZeros(mask);
+	}
+#endif
+
+#ifdef TEM_SCAN_SSE2
+	const __m128i below32_128 = _mm_set1_epi8(0x1F);
+	const __m128i del_128 = _mm_set1_epi8(0x7F);
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		__m128i printable = _mm_andnot_si128(_mm_cmpeq_epi8(chunk, del_128), _mm_cmpgt_epi8(chunk, below32_128));
+		uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(printable)) & 0xFFFF;
+		if (mask != 0)
+			return i + countTrailingZeros(mask);
+	}
+#endif
+
+	for (; i < len; ++i) {
+		if (!isPrintableAscii(static_cast<unsigned char>(data[i])))
+			return i;
+	}
+	return len;
+}
+
+size_t findControlByte(const char* data, size_t len) {
+	size_t i = 0;
+
+	// As signed bytes the C0 range is exactly 0 <= b < 0x20, everything >= 0x80 is negative and passes
+#ifdef TEM_SCAN_AVX2
+	const __m256i negative = _mm256_set1_epi8(-1);
+	const __m256i space = _mm256_set1_epi8(0x20);
+	const __m256i del = _mm256_set1_epi8(0x7F);
+	for (; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+		__m256i c0 = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, negative), _mm256_cmpgt_epi8(space, chunk));
+		uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(c0, _mm256_cmpeq_epi8(chunk, del))));
+		if (mask != 0)
+			return i + countTrailingZeros(mask);
+	}
+#endif
+
+#ifdef TEM_SCAN_SSE2
+	const __m128i negative_128 = _mm_set1_epi8(-1);
+	const __m128i space_128 = _mm_set1_epi8(0x20);
+	const __m128i del_128 = _mm_set1_epi8(0x7F);
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		__m128i c0 = _mm_and_si128(_mm_cmpgt_epi8(chunk, negative_128), _mm_cmplt_epi8(chunk, space_128));
+		uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(c0, _mm_cmpeq_epi8(chunk, del_128))));
+		if (mask != 0)
+			return i + countTrailingZeros(mask);
+	}
+#endif
+
+	for (; i < len; ++i) {
+		if (isControl(static_cast<unsigned char>(data[i])))
+			return i;
+	}
+	return len;
+}
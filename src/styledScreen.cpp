@@ -3,19 +3,64 @@
 #include "styledScreen.h"
 #include "styledScreen.h"
 #include "styledScreen.h"
+#include <algorithm>
 #include <platform/tools.h>
 #include "main.h"
 #include <iostream>
 
 StyledChar makeStyledChar(char32_t ch) {
-	return StyledChar{ch, o.procState.currFG, o.procState.currBG, o.procState.currAttr};
+	return StyledChar{ch, o.procState.pen};
 }
 
-StyledScreen::StyledScreen() : cellsH(0), cellsW(0), screen(nullptr) {
+StyleTable::StyleTable() {
+	clear();
+}
+
+uint32_t StyleTable::intern(const CellStyle& style) {
+	auto it = ids.find(style.key());
+	if (it != ids.end()) {
+		return it->second;
+	}
+	uint32_t id;
+	if (!freeIds.empty()) {
+		id = freeIds.back();
+		freeIds.pop_back();
+		styles[id] = style;
+	} else {
+		id = static_cast<uint32_t>(styles.size());
+		styles.push_back(style);
+	}
+	ids.emplace(style.key(), id);
+	return id;
+}
+
+void StyleTable::release(uint32_t id) {
+	if (id == DefaultStyle || id >= styles.size()) {
+		return;
+	}
+	auto it = ids.find(styles[id].key());
+	if (it == ids.end() || it->second != id) {
+		return;
+	}
+	ids.erase(it);
+	freeIds.push_back(id);
+}
+
+void StyleTable::clear() {
+	styles.clear();
+	freeIds.clear();
+	ids.clear();
+	intern(CellStyle{}); // DefaultStyle
+}
+
+StyledScreen::StyledScreen()
+	: cellsH(0), cellsW(0), screen(nullptr), otherScreen(nullptr),
+	  scrollback(DefaultScrollbackBytes, DefaultScrollbackSpillBytes) {
 }
 
 StyledScreen::~StyledScreen() {
 	delete[] screen;
+	delete[] otherScreen;
 }
 
 void StyledScreen::resize(int width, int height) {
@@ -24,38 +69,187 @@ void StyledScreen::resize(int width, int height) {
 	}
 	permaAssertDevelopement(width > 0 && height > 0);
 
-	// Save old data
-	StyledChar* oldScreen = screen;
-	int oldW = cellsW;
-	int oldH = cellsH;
-
-	// Update to new size
+	// Only the primary screen is reflowed, programs using the alternate one redraw it on resize anyway
+	if (alternateActive) {
+		reflowBuffer(otherScreen, otherRowSlots, otherRowHead, otherSlotWrapped, width, height, primaryCursorX,
+					 primaryCursorY);
+		resizeBuffer(screen, rowSlots, rowHead, slotWrapped, width, height);
+	} else {
+		reflowBuffer(screen, rowSlots, rowHead, slotWrapped, width, height, o.cursorX, o.cursorY);
+		resizeBuffer(otherScreen, otherRowSlots, otherRowHead, otherSlotWrapped, width, height);
+	}
 	cellsW = width;
 	cellsH = height;
-	screen = new StyledChar[width * height];
+	scrollTop = 0;
+	scrollBottom = height - 1;
+	dirtyRows.resize((height + 63) / 64);
+	markAllDirty();
+}
+
+void StyledScreen::resizeBuffer(StyledChar*& cells, std::vector<int>& slots, int& head,
+								std::vector<uint8_t>& wrapped, int width, int height) {
+	// Save old data
+	StyledChar* oldCells = cells;
+	cells = new StyledChar[width * height];
 
 	// Copy overlapping region from old screen
-	int minW = (oldW > 0) ? std::min(oldW, width) : 0;
-	int minH = (oldH > 0) ? std::min(oldH, height) : 0;
+	int minW = oldCells ? std::min(cellsW, width) : 0;
+	int minH = oldCells ? std::min(cellsH, height) : 0;
 	for (int y = 0; y < minH; ++y) {
+		int oldSlot = slots[(head + y) % cellsH];
 		for (int x = 0; x < minW; ++x) {
-			screen[y * width + x] = oldScreen[y * oldW + x];
+			cells[y * width + x] = oldCells[oldSlot * cellsW + x];
 		}
 	}
+	slots.resize(height);
+	for (int y = 0; y < height; ++y) {
+		slots[y] = y;
+	}
+	head = 0;
+	wrapped.assign(height, 0);
 
 	// Fill new/empty cells with default StyledChar
 	for (int y = 0; y < height; ++y) {
 		for (int x = (y < minH ? minW : 0); x < width; ++x) {
-			screen[y * width + x] = makeStyledChar(U' ');
+			cells[y * width + x] = makeStyledChar(U' ');
 		}
 	}
 
 	// Clean up old data
-	delete[] oldScreen;
+	delete[] oldCells;
+}
+
+void StyledScreen::reflowBuffer(StyledChar*& cells, std::vector<int>& slots, int& head,
+								std::vector<uint8_t>& wrapped, int width, int height, int& cursorX, int& cursorY) {
+	if (!cells) {
+		resizeBuffer(cells, slots, head, wrapped, width, height);
+		return;
+	}
+	auto oldSlot = [&](int y) { return slots[(head + y) % cellsH]; };
+	auto oldRow = [&](int y) { return cells + oldSlot(y) * cellsW; };
+
+	// Blank rows below the cursor are left out
+	int cursorRow = std::clamp(cursorY, 0, cellsH - 1);
+	int used = cursorRow + 1;
+	for (int y = cellsH - 1; y >= used; --y) {
+		if (!std::all_of(oldRow(y), oldRow(y) + cellsW, [](const StyledChar& c) { return c.isBlank(); })) {
+			used = y + 1;
+			break;
+		}
+	}
+
+	// Join the rows of each logical line and split it again at the new width
+	StyledChar blank = makeStyledChar(U' ');
+	std::vector<StyledChar> rows; // width cells each
+	std::vector<uint8_t> rowsWrapped;
+	std::vector<StyledChar> text;
+	// A line that scrolled off while wrapping onto the first row is reflowed as one with it
+	scrollback.takeOpenLine(text);
+	int newCursorX = 0;
+	int newCursorY = 0;
+	for (int y = 0; y < used; text.clear()) {
+		size_t cursorOffset = SIZE_MAX;
+		bool more = true;
+		for (; more && y < used; ++y) {
+			const StyledChar* row = oldRow(y);
+			more = wrapped[oldSlot(y)];
+			int len = cellsW;
+			while (!more && len > 0 && row[len - 1].isBlank()) {
+				len--;
+			}
+			if (y == cursorRow) {
+				cursorOffset = text.size() + std::min(cursorX, cellsW);
+			}
+			text.insert(text.end(), row, row + len);
+		}
+		size_t lineRows = std::max<size_t>(1, (text.size() + width - 1) / width);
+		size_t firstRow = rowsWrapped.size();
+		if (cursorOffset != SIZE_MAX) {
+			lineRows = std::max(lineRows, cursorOffset / width + 1);
+			newCursorY = static_cast<int>(firstRow + cursorOffset / width);
+			newCursorX = static_cast<int>(cursorOffset % width);
+		}
+		rows.resize((firstRow + lineRows) * width, blank);
+		std::copy(text.begin(), text.end(), rows.begin() + firstRow * width);
+		for (size_t r = 0; r < lineRows; ++r) {
+			rowsWrapped.push_back(r + 1 < lineRows);
+		}
+	}
+
+	// Rows that don't fit scroll into scrollback as long as the cursor stays on screen, the rest is cut
+	int total = static_cast<int>(rowsWrapped.size());
+	int pushed = std::min(std::max(0, total - height), newCursorY);
+	for (int r = 0; r < pushed; ++r) {
+		scrollback.push(&rows[r * width], width, rowsWrapped[r]);
+	}
+
+	delete[] cells;
+	cells = new StyledChar[width * height];
+	std::fill(cells, cells + width * height, blank);
+	slots.resize(height);
+	head = 0;
+	wrapped.assign(height, 0);
+	for (int y = 0; y < height; ++y) {
+		slots[y] = y;
+		if (pushed + y < total) {
+			std::copy_n(&rows[(pushed + y) * width], width, cells + y * width);
+			wrapped[y] = rowsWrapped[pushed + y];
+		}
+	}
+	cursorX = newCursorX;
+	cursorY = newCursorY - pushed;
+}
+
+StyledChar* StyledScreen::rowPtr(int y) const {
+	return screen + rowSlots[slotIndex(y)] * cellsW;
+}
+
+void StyledScreen::clearRow(int y) {
+	StyledChar blank = makeStyledChar(U' ');
+	std::fill(rowPtr(y), rowPtr(y) + cellsW, blank);
+	slotWrapped[rowSlots[slotIndex(y)]] = 0;
+	markDirty(y);
+}
+
+void StyledScreen::shiftDirty(int count) {
+	count = std::clamp(count, -cellsH, cellsH);
+	// The dirty bits move with their rows, the rows coming in are marked by clearRow
+	if (count > 0) {
+		for (int y = 0; y + count < cellsH; ++y) {
+			dirtyRows[y >> 6] &= ~(uint64_t(1) << (y & 63));
+			dirtyRows[y >> 6] |= uint64_t(isRowDirty(y + count)) << (y & 63);
+		}
+	} else {
+		for (int y = cellsH - 1; y + count >= 0; --y) {
+			dirtyRows[y >> 6] &= ~(uint64_t(1) << (y & 63));
+			dirtyRows[y >> 6] |= uint64_t(isRowDirty(y + count)) << (y & 63);
+		}
+	}
+	scrollDelta = std::clamp(scrollDelta + count, -cellsH, cellsH);
+}
+
+void StyledScreen::markAllDirty() {
+	std::fill(dirtyRows.begin(), dirtyRows.end(), ~uint64_t(0));
+	scrollDelta = 0;
+}
+
+void StyledScreen::clearDamage() {
+	std::fill(dirtyRows.begin(), dirtyRows.end(), 0);
+	scrollDelta = 0;
+}
+
+void StyledScreen::setWrapped(int y) {
+	if (y >= 0 && y < cellsH) {
+		slotWrapped[rowSlots[slotIndex(y)]] = 1;
+	}
+}
+
+bool StyledScreen::isWrapped(int y) const {
+	return slotWrapped[rowSlots[slotIndex(y)]] != 0;
 }
 
 StyledLine StyledScreen::at(int idx) const {
-	return StyledLine(screen + cellsW * idx, cellsW);
+	return StyledLine(rowPtr(idx), cellsW);
 }
 
 StyledLine StyledScreen::operator[](int index) const {
@@ -77,22 +271,16 @@ int StyledScreen::size() const {
 void StyledScreen::clear() {
 	if (!screen)
 		return;
-	for (int y = 0; y < cellsH; ++y) {
-		for (int x = 0; x < cellsW; ++x) {
-			screen[y * cellsW + x] = makeStyledChar(U' ');
-		}
-	}
+	std::fill(screen, screen + cellsW * cellsH, makeStyledChar(U' '));
+	std::fill(slotWrapped.begin(), slotWrapped.end(), 0);
+	markAllDirty();
 }
 
 void StyledScreen::clearScrollback() {
-	scrollbackBuffer.clear();
+	scrollback.clear();
 	clear();
 }
 
-StyledChar* StyledScreen::data() {
-	return screen;
-}
-
 StyledChar& StyledScreen::atCursor() {
 	if (o.cursorX >= cellsW) {
 		o.cursorX = cellsW - 1;
@@ -100,43 +288,201 @@ StyledChar& StyledScreen::atCursor() {
 	if (o.cursorY >= cellsH) {
 		o.cursorY = cellsH - 1;
 	}
-	StyledChar& cursorChar = screen[o.cursorY * cellsW + o.cursorX];
+	StyledChar& cursorChar = rowPtr(o.cursorY)[o.cursorX];
+	markDirty(o.cursorY);
 	return cursorChar;
 }
 
+StyledLine StyledScreen::editRow(int y) {
+	if (y < 0 || y >= cellsH) {
+		permaAssertDevelopement(false);
+		return StyledLine();
+	}
+	markDirty(y);
+	return at(y);
+}
+
+void StyledScreen::eraseCells(int y, int from, int to) {
+	if (y < 0 || y >= cellsH) {
+		return;
+	}
+	from = std::clamp(from, 0, cellsW);
+	to = std::clamp(to, from, cellsW);
+	StyledChar* row = rowPtr(y);
+	std::fill(row + from, row + to, makeStyledChar(U' '));
+	if (to == cellsW) {
+		slotWrapped[rowSlots[slotIndex(y)]] = 0;
+	}
+	markDirty(y);
+}
+
+void StyledScreen::writeRun(const char* text, int count) {
+	StyledChar* cell = &atCursor();
+	count = std::min(count, cellsW - o.cursorX);
+	StyledChar pen = makeStyledChar(U' ');
+	for (int i = 0; i < count; ++i) {
+		pen.ch = static_cast<unsigned char>(text[i]);
+		cell[i] = pen;
+	}
+}
+
+void StyledScreen::writeRun(const char32_t* text, int count) {
+	StyledChar* cell = &atCursor();
+	count = std::min(count, cellsW - o.cursorX);
+	StyledChar pen = makeStyledChar(U' ');
+	for (int i = 0; i < count; ++i) {
+		pen.ch = text[i];
+		cell[i] = pen;
+	}
+}
+
 void StyledScreen::newLine() {
-	// Save the top line to scrollback if we're at the bottom
-	if (o.cursorY >= cellsH - 1) {
-		// Copy the first line to scrollback
-		std::vector<StyledChar> line(screen, screen + cellsW);
-		scrollbackBuffer.push_back(std::move(line));
-		if (scrollbackBuffer.size() > MaxScrollbackLines) {
-			scrollbackBuffer.pop_front();
-		}
-		// Scroll all lines up
-		memmove(screen, screen + cellsW, sizeof(StyledChar) * cellsW * (cellsH - 1));
-		// Clear the last line
-		for (int x = 0; x < cellsW; ++x) {
-			screen[(cellsH - 1) * cellsW + x] = makeStyledChar(U' ');
-		}
+	if (o.cursorY >= cellsH) {
 		o.cursorY = cellsH - 1;
-	} else {
+	}
+	if (o.cursorY == scrollBottom) {
+		scrollUp(1);
+	} else if (o.cursorY < cellsH - 1) {
 		o.cursorY++;
 	}
 }
 
+void StyledScreen::reverseNewLine() {
+	if (o.cursorY == scrollTop) {
+		scrollDown(1);
+	} else if (o.cursorY > 0) {
+		o.cursorY--;
+	}
+}
+
+void StyledScreen::scrollUp(int count) {
+	scrollRows(scrollTop, scrollBottom, count);
+}
+
+void StyledScreen::scrollDown(int count) {
+	scrollRows(scrollTop, scrollBottom, -count);
+}
+
+void StyledScreen::insertLines(int y, int count) {
+	if (y >= scrollTop && y <= scrollBottom) {
+		scrollRows(y, scrollBottom, -count);
+	}
+}
+
+void StyledScreen::deleteLines(int y, int count) {
+	if (y >= scrollTop && y <= scrollBottom) {
+		scrollRows(y, scrollBottom, count);
+	}
+}
+
+void StyledScreen::setScrollRegion(int top, int bottom) {
+	if (top < 0 || bottom >= cellsH || top >= bottom) {
+		return;
+	}
+	scrollTop = top;
+	scrollBottom = bottom;
+}
+
+int StyledScreen::getScrollTop() const {
+	return scrollTop;
+}
+
+int StyledScreen::getScrollBottom() const {
+	return scrollBottom;
+}
+
+uint32_t StyledScreen::internStyle(const CellStyle& style) {
+	if (styles.size() >= styleSweepAt) {
+		sweepStyles();
+		styleSweepAt = std::max(MinStyleSweep, styles.size() * 2);
+	}
+	return styles.intern(style);
+}
+
+void StyledScreen::sweepStyles() {
+	std::vector<uint8_t> used(styles.idLimit(), 0);
+	for (int i = 0; i < cellsW * cellsH; ++i) {
+		used[screen[i].style] = 1;
+		used[otherScreen[i].style] = 1;
+	}
+	used[o.procState.pen] = 1;
+	// Spilled scrollback keeps the ids it was written with, so they are only reused once their lines are gone
+	for (uint32_t id = 0; id < used.size(); ++id) {
+		if (!used[id] && !scrollback.usesStyle(id)) {
+			styles.release(id);
+		}
+	}
+}
+
+void StyledScreen::scrollRows(int top, int bottom, int count) {
+	int height = bottom - top + 1;
+	if (count == 0 || height <= 0) {
+		return;
+	}
+	bool fullScreen = top == 0 && bottom == cellsH - 1;
+	if (fullScreen) {
+		shiftDirty(count);
+	} else {
+		for (int y = top; y <= bottom; ++y) {
+			markDirty(y);
+		}
+	}
+	if (count > 0) {
+		count = std::min(count, height);
+		// Like a terminal would, only lines leaving a full screen region are kept
+		if (!alternateActive && fullScreen) {
+			for (int i = 0; i < count; ++i) {
+				StyledChar* row = rowPtr(i);
+				scrollback.push(row, cellsW, isWrapped(i));
+			}
+		}
+		// The slots of the rows leaving at the top are reused for the blank rows coming in at the bottom
+		if (fullScreen) {
+			rowHead = slotIndex(count % cellsH);
+		} else {
+			rotateRows(top, bottom, count);
+		}
+		for (int y = bottom - count + 1; y <= bottom; ++y) {
+			clearRow(y);
+		}
+	} else {
+		count = std::min(-count, height);
+		if (fullScreen) {
+			rowHead = slotIndex((cellsH - count) % cellsH);
+		} else {
+			rotateRows(top, bottom, height - count);
+		}
+		for (int y = top; y < top + count; ++y) {
+			clearRow(y);
+		}
+	}
+}
+
+void StyledScreen::rotateRows(int top, int bottom, int count) {
+	// std::rotate through slotIndex, the rows may wrap around the end of the ring
+	auto reverse = [&](int first, int last) {
+		for (--last; first < last; ++first, --last) {
+			std::swap(rowSlots[slotIndex(first)], rowSlots[slotIndex(last)]);
+		}
+	};
+	reverse(top, top + count);
+	reverse(top + count, bottom + 1);
+	reverse(top, bottom + 1);
+}
+
 std::vector<tcb::span<StyledChar>> StyledScreen::getSnapshotView(int scrollbackOffset) {
 	std::vector<tcb::span<StyledChar>> snapshot;
 	snapshot.reserve(cellsH);
+	snapshotRows.resize(cellsH);
 
 	// Clamp scrollbackOffset to valid range
-	int maxScroll = static_cast<int>(scrollbackBuffer.size());
+	int maxScroll = static_cast<int>(scrollback.rowCount(cellsW));
 	if (scrollbackOffset < 0)
 		scrollbackOffset = 0;
 	if (scrollbackOffset > maxScroll)
 		scrollbackOffset = maxScroll;
 
-	// The first line to show is at: scrollbackBuffer.size() - scrollbackOffset
+	// The first line to show is at: scrollback.size() - scrollbackOffset
 	int firstLineIdx = maxScroll - scrollbackOffset;
 
 	for (int i = 0; i < cellsH; ++i) {
@@ -146,13 +492,12 @@ std::vector<tcb::span<StyledChar>> StyledScreen::getSnapshotView(int scrollbackO
 			snapshot.emplace_back();
 		} else if (lineIdx < maxScroll) {
 			// From scrollback buffer
-			std::vector<StyledChar>& vec = scrollbackBuffer[lineIdx];
-			snapshot.emplace_back(vec.data(), vec.size());
+			snapshot.push_back(scrollback.readRow(lineIdx, cellsW, snapshotRows[i]));
 		} else {
 			// From current screen
 			int screenLine = lineIdx - maxScroll;
 			if (screenLine < cellsH) {
-				snapshot.emplace_back(screen + screenLine * cellsW, cellsW);
+				snapshot.emplace_back(rowPtr(screenLine), cellsW);
 			} else {
 				snapshot.emplace_back();
 			}
@@ -161,31 +506,31 @@ std::vector<tcb::span<StyledChar>> StyledScreen::getSnapshotView(int scrollbackO
 	return snapshot;
 }
 
-ScreenState StyledScreen::getScreenState() const {
-	ScreenState state;
-	state.width = cellsW;
-	state.height = cellsH;
-	state.scrollback = scrollbackBuffer;
-	state.screen.assign(screen, screen + cellsW * cellsH);
-	state.cursorX = o.cursorX;
-	state.cursorY = o.cursorY;
-	return state;
+void StyledScreen::setScrollbackBudget(size_t bytes) {
+	scrollback.setBudget(bytes);
+}
+
+void StyledScreen::setScrollbackSpillBudget(size_t bytes) {
+	scrollback.setSpillBudget(bytes);
 }
 
-void StyledScreen::setScreenState(const ScreenState& state) {
-	// Resize if needed
-	if (cellsW != state.width || cellsH != state.height) {
-		resize(state.width, state.height);
+void StyledScreen::setAlternateScreen(bool alternate) {
+	if (alternate == alternateActive) {
+		return;
 	}
-	scrollbackBuffer = state.scrollback;
-	if (state.screen.size() == static_cast<size_t>(cellsW * cellsH)) {
-		std::copy(state.screen.begin(), state.screen.end(), screen);
-	} else {
-		// Fallback: clear if size mismatch
+	if (alternate) {
+		primaryCursorX = o.cursorX;
+		primaryCursorY = o.cursorY;
+	}
+	std::swap(screen, otherScreen);
+	rowSlots.swap(otherRowSlots);
+	std::swap(rowHead, otherRowHead);
+	slotWrapped.swap(otherSlotWrapped);
+	alternateActive = alternate;
+	markAllDirty();
+	if (alternate) {
 		clear();
 	}
-	o.cursorX = state.cursorX;
-	o.cursorY = state.cursorY;
 }
 
 std::string StyledScreen::lineToString(const StyledLine& line) {
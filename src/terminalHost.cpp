@@ -0,0 +1,15 @@
+#include "terminalHost.h"
+
+namespace
+{
+TerminalHost headlessHost;
+TerminalHost* currentHost = &headlessHost;
+}
+
+void setTerminalHost(TerminalHost* host) {
+	currentHost = host ? host : &headlessHost;
+}
+
+TerminalHost& getTerminalHost() {
+	return *currentHost;
+}
@@ -1,30 +1,109 @@
 #include "utf8.h"
+#include <cstring>
 
-int decode_utf8(const char* s, char32_t* codepoint) {
-	uint8_t c = static_cast<uint8_t>(s[0]);
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TEM_UTF8_SSE2 1
+#endif
 
-	if (c < 0x80) {
-		*codepoint = c;
-		return 1;
-	} else if (c < 0xC0) {
-		return 0; // invalid: continuation byte can't start a character
-	} else if (c < 0xE0) {
-		if ((s[1] & 0xC0) != 0x80)
-			return 0;
-		*codepoint = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
-		return 2;
-	} else if (c < 0xF0) {
-		if ((s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80)
-			return 0;
-		*codepoint = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
-		return 3;
-	} else if (c < 0xF8) {
-		if ((s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80 || (s[3] & 0xC0) != 0x80)
+namespace
+{
+#ifdef TEM_UTF8_SSE2
+// Widens 16 ASCII bytes to 16 codepoints
+inline void widenAscii16(__m128i bytes, char32_t* out) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_unpacklo_epi8(bytes, zero);
+	__m128i hi = _mm_unpackhi_epi8(bytes, zero);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 0), _mm_unpacklo_epi16(lo, zero));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4), _mm_unpackhi_epi16(lo, zero));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpacklo_epi16(hi, zero));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 12), _mm_unpackhi_epi16(hi, zero));
+}
+#endif
+}
+
+size_t decode_utf8_stream(Utf8Decoder& state, const char* data, size_t len, char32_t* out, size_t outCap,
+						  size_t* consumed) {
+	const uint8_t* s = reinterpret_cast<const uint8_t*>(data);
+	size_t i = 0;
+	size_t n = 0;
+
+	while (i < len && n < outCap) {
+		if (!state.pending()) {
+#ifdef TEM_UTF8_SSE2
+			// Whole blocks without a high bit set are plain ASCII, validated and widened 16 at a time
+			while (i + 16 <= len && n + 16 <= outCap) {
+				__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+				if (_mm_movemask_epi8(chunk) != 0)
+					break;
+				widenAscii16(chunk, out + n);
+				i += 16;
+				n += 16;
+			}
+			if (i >= len || n >= outCap)
+				break;
+#endif
+			uint8_t c = s[i++];
+			if (c < 0x80) {
+				out[n++] = c;
+			} else if (c >= 0xC2 && c <= 0xDF) {
+				state = {static_cast<char32_t>(c & 0x1F), 1, 0x80, 0xBF};
+			} else if (c >= 0xE0 && c <= 0xEF) {
+				// E0 would be overlong below A0, ED would be a surrogate above 9F
+				state = {static_cast<char32_t>(c & 0x0F), 2, uint8_t(c == 0xE0 ? 0xA0 : 0x80),
+						 uint8_t(c == 0xED ? 0x9F : 0xBF)};
+			} else if (c >= 0xF0 && c <= 0xF4) {
+				// F0 would be overlong below 90, F4 would be past U+10FFFF above 8F
+				state = {static_cast<char32_t>(c & 0x07), 3, uint8_t(c == 0xF0 ? 0x90 : 0x80),
+						 uint8_t(c == 0xF4 ? 0x8F : 0xBF)};
+			} else {
+				out[n++] = ReplacementCharacter; // stray continuation byte, C0/C1 overlong lead or F5..FF
+			}
+			continue;
+		}
+
+		uint8_t c = s[i];
+		if (c < state.lower || c > state.upper) {
+			// Broken sequence, this byte is looked at again as the start of something new
+			out[n++] = ReplacementCharacter;
+			state = {};
+			continue;
+		}
+		i++;
+		state.codepoint = (state.codepoint << 6) | (c & 0x3F);
+		state.lower = 0x80;
+		state.upper = 0xBF;
+		if (--state.remaining == 0) {
+			out[n++] = state.codepoint;
+			state = {};
+		}
+	}
+
+	*consumed = i;
+	return n;
+}
+
+bool reset_utf8_stream(Utf8Decoder& state) {
+	bool hadPending = state.pending();
+	state = {};
+	return hadPending;
+}
+
+int decode_utf8(const char* s, size_t len, char32_t* codepoint) {
+	Utf8Decoder state;
+	for (size_t i = 0; i < len && i < 4; ++i) {
+		char32_t cp;
+		size_t consumed = 0;
+		if (decode_utf8_stream(state, s + i, 1, &cp, 1, &consumed) == 0)
+			continue; // sequence not finished yet
+		// A replacement either came from a rejected lead byte or from a continuation byte that was not consumed
+		bool valid = consumed == 1 && (i > 0 || static_cast<uint8_t>(s[0]) < 0x80);
+		if (!valid)
 			return 0;
-		*codepoint = ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
-		return 4;
+		*codepoint = cp;
+		return static_cast<int>(i + 1);
 	}
-	return 0; // invalid: > 4-byte UTF-8 (not supported)
+	return 0; // truncated
 }
 
 int encode_utf8(char32_t codepoint, char* out) {
@@ -60,7 +139,7 @@ int get_length(std::string_view sv) {
 	int i = 0;
 	char32_t codepoint;
 	for (i = 0; i < sv.size(); i++) {
-		int len = decode_utf8(sv.data() + i, &codepoint);
+		int len = decode_utf8(sv.data() + i, sv.size() - i, &codepoint);
 		if (len == 0) {
 			return -1;
 		}
@@ -71,6 +150,6 @@ int get_length(std::string_view sv) {
 
 int codepoint_length(const char* s) {
 	char32_t codepoint;
-	int len = decode_utf8(s, &codepoint);
+	int len = decode_utf8(s, strnlen(s, 4), &codepoint);
 	return len;
 }